@@ -1,15 +1,25 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/types.h>
+
+#include "mccharmap.h"
 
 #define MEM_SIZE 4096
 
+// limits for the macro layer
+#define MACRO_PARAMS 8
+#define MACRO_DEPTH  16
+#define WORD_SIZE    48
+
 typedef struct var {
 	u_int16_t addr;
 	u_int16_t size; // unused as of now
 	u_int16_t value;
+	u_int8_t label;
+	u_int8_t evaluating, evaluated;
 	char name[16];
-	char pointsTo[16];
+	char expr[48];
 } Var;
 
 typedef struct oper {
@@ -18,7 +28,29 @@ typedef struct oper {
 	u_int16_t addr;
 } Oper;
 
+typedef struct macro {
+	char name[16];
+	int paramcount;
+	char params[MACRO_PARAMS][WORD_SIZE];
+	char *body;
+} Macro;
+
+static size_t macrocount = 0, macrosize = 0;
+static Macro *macros = NULL;
+static unsigned int expansions = 0;
+
 int readVarName (FILE *, int *, char *);
+int readValue (FILE *, int *, char *, size_t);
+int evalVar (Var *, Var *, size_t, int);
+int evalTerm (const char *, size_t, Var *, size_t, int, long *);
+Var *findVar (const char *, Var *, size_t);
+FILE *preprocess (FILE *);
+int expandText (const char *, FILE *, int);
+const char *findBlockEnd (const char *, const char **);
+char *substitute (const char *, char (*)[WORD_SIZE], char (*)[WORD_SIZE], int, int);
+void writeSparse (FILE *, const u_int16_t *, size_t);
+void writeMetadata (FILE *, Oper *, size_t, Var *, size_t, int);
+void writeWord (FILE *, u_int16_t);
 
 int main (int argc, char **argv) {
 	// command line args
@@ -28,8 +60,11 @@ int main (int argc, char **argv) {
 		int quiet;
 		int help;
 		int decimal;
+		int sparse;
+		int metadata;
 		char *inPath;
 		char *outPath;
+		char *symPath;
 	} args = { 0 };
 	
 	for (int i = 1, getSwitches = 1; i < argc; i++) {
@@ -43,6 +78,11 @@ int main (int argc, char **argv) {
 			case 'q': args.quiet     = 1; break;
 			case 'h': args.help      = 1; break;
 			case 'd': args.decimal   = 1; break;
+			case 'r': args.sparse    = 1; break;
+			case 'e': args.metadata  = 1; break;
+			case 's':
+				if (i + 1 < argc) args.symPath = argv[++i];
+				break;
 			}
 		}
 		// we have a filepath
@@ -58,9 +98,19 @@ int main (int argc, char **argv) {
 		puts("  -q    Don't output anything");
 		puts("  -h    Show help");
 		puts("  -d    Write image as newline separated decimal numbers");
+		puts("  -s    Write symbol table to the file in the next arg");
+		puts("  -r    Write image in the sparse run-length format");
+		puts("  -e    Write a metadata section after the image");
 		return EXIT_SUCCESS;
 	}
 
+	if (args.metadata && args.decimal) {
+		fprintf (
+			stderr, "%s: decimal images cannot hold metadata\n",
+			argv[0]);
+		return EXIT_FAILURE;
+	}
+
 	if ((args.inPath == NULL && !args.stdin) || args.outPath == NULL) {
 		fprintf (
 			stderr, "%s: please provide input and output files\n",
@@ -74,6 +124,7 @@ int main (int argc, char **argv) {
 			argv[0], args.inPath, args.outPath);
 	}
 
+	char *badexpr = NULL;
 	size_t varcount = 0,
 	varsize  = 4;
 	Var *vars = malloc(varsize * sizeof(Var));
@@ -93,6 +144,15 @@ int main (int argc, char **argv) {
 		return EXIT_FAILURE;
 	}
 
+	// expand macros and repeat blocks before anything else sees the source
+	in = preprocess(in);
+	if (in == NULL) {
+		fprintf (
+			stderr, "%s: ERR could not expand macros in %s\n", argv[0],
+			args.inPath);
+		return EXIT_FAILURE;
+	}
+
 	// get variables
 	int ch;
 	while ((ch = fgetc(in)) != '-') {
@@ -107,47 +167,30 @@ int main (int argc, char **argv) {
 		if (readVarName(in, &ch, var->name)) goto premature_eof_err;
 		if (var->name[0] == '.') var->name[0] = 0;
 		var->size = 1;
+		var->label = 0;
 		var->addr = 0xFFF;
-		var->pointsTo[0] = 0;
+		var->evaluating = var->evaluated = 0;
+		var->expr[0] = 0;
+		var->value = 0;
 
 		// skip whitespace
 		while ((ch = fgetc(in)) == ' ' || ch == '\t');
 
-		if (args.minecraft && ch == '&') {
-			// this is a pointer
-			ch = fgetc(in);
-			if (readVarName(in, &ch, var->pointsTo)) goto premature_eof_err;
-			var->value = 0;
-		} else {
-			// get hex value
-			int mult = 4096;
-			var->value = 0;
-			for (int i = 0; i < 4; i++) {
-				// if we reach whitespace its time to stop!!!
-				if(ch == ' ' || ch == '\t' || ch == '\n') break;
-				// only accept valid hex chars
-				if(ch < 47 || (ch > 57 && ch < 65 ) || (ch > 70 && ch < 97) || ch > 102) {
-					goto invalid_hex_err;
-				}
-
-				if (ch <= 57) ch -= 48;
-				else if (ch <= 90) ch -= 55;
-				else ch -= 87;
-				ch *= mult;
-				var->value += ch;
+		char value[sizeof(var->expr)];
+		if (readValue(in, &ch, value, sizeof(value))) goto invalid_hex_err;
 
-				mult /= 16;
-				ch = fgetc(in);
-			}
-		}
+		// values are worked out once every variable is known and has an
+		// address, since a value that looks like hex might be the name
+		// of a variable further down
+		strcpy(var->expr, value);
 
 		// skip trailing stuff
-		while (ch != '\n' && ch != EOF) { ch = fgetc(in) };
+		while (ch != '\n' && ch != EOF) { ch = fgetc(in); }
 
 		if (!args.quiet) {
 			printf("got variable:\t[%s]\t", var->name);
-			if (var->pointsTo[0] != 0) {
-				printf("[&%s]", var->pointsTo);
+			if (var->expr[0] != 0) {
+				printf("[%s]", var->expr);
 			} else {
 				printf("[%03x]", var->value);
 			}
@@ -303,6 +346,7 @@ int main (int argc, char **argv) {
 			if (readVarName(in, &ch, label->name))
 				goto premature_eof_err;
 			label->size = 1;
+			label->label = 1;
 			label->addr = (u_int16_t)(opercount);
 
 			if (!args.quiet)
@@ -328,24 +372,41 @@ int main (int argc, char **argv) {
 			var->addr = (u_int16_t)(index);
 			index += var->size;
 			if (!args.quiet)
-				printf ("variable %s\tinhabits %03x",
+				printf ("variable %s\tinhabits %03x\n",
 					var->name, var->addr);
-			// if var is a pointer, find what it points to
-			if (var->pointsTo[0] != 0) {
-				for (size_t j = 0; j < varcount; j++) {
-					if (strcmp(var->pointsTo, vars[j].name) == 0) {
-						if (vars[j].addr == 0xFFF)
-							goto invalid_symbol_err;
-						else
-							var->value = vars[j].addr;
-					}
-				}
-				printf(" and points to %03x", var->value);
-			}
-			putchar('\n');
 		}
 	}
 
+	// work out constant expressions now that addresses are known
+	for (size_t i = 0; i < varcount; i++) {
+		if (vars[i].label || vars[i].expr[0] == 0) continue;
+		if (evalVar(&vars[i], vars, varcount, args.minecraft)) {
+			badexpr = vars[i].expr;
+			goto invalid_symbol_err;
+		}
+		if (!args.quiet)
+			printf ("variable %s\tis %s = %04x\n",
+				vars[i].name, vars[i].expr, vars[i].value);
+	}
+
+	// write symbol table
+	if (args.symPath != NULL) {
+		FILE *sym = fopen(args.symPath, "w");
+		if (sym == NULL) {
+			fprintf (stderr,
+				"%s: ERR could not open file %s\n",
+				argv[0], args.symPath);
+			return EXIT_FAILURE;
+		}
+		for (size_t i = 0; i < varcount; i++) {
+			if (vars[i].name[0] == 0) continue;
+			fprintf (
+				sym, "%03x %s %i\n", vars[i].addr, vars[i].name,
+				vars[i].label ? 0 : 1);
+		}
+		fclose(sym);
+	}
+
 	FILE *out = fopen(args.outPath, "w");
 	if (out == NULL) {
 		fprintf (stderr,
@@ -355,6 +416,8 @@ int main (int argc, char **argv) {
 	}
 
 	u_int16_t memaddr = 0;
+	size_t cellcount = 0;
+	u_int16_t *cells = malloc((opercount + varcount) * sizeof(u_int16_t));
 
 	// write program section
 	for (size_t i = 0; i < opercount; i++) {
@@ -376,22 +439,20 @@ int main (int argc, char **argv) {
 				oper->addr = vars[j].addr;
 			}
 		}
-		u_int16_t cell = (opers[i].opcode & 0xF) << 12 | (oper->addr & 0xFFF);
-
-		if (args.decimal) {
-			fprintf(out, "%i\n", cell);
-		} else {
-			fputc(cell >> 8, out);
-			fputc(cell & 0xFF, out);
-			if (!args.quiet) {
-				printf("memory[%04x]: %04x\n", memaddr++, cell); 
-			}
-		}
+		cells[cellcount++] =
+			(u_int16_t)((opers[i].opcode & 0xF) << 12 | (oper->addr & 0xFFF));
 	}
 
-	// write data section
+	// write data section. labels don't take up any memory.
 	for (size_t i = 0; i < varcount; i++) {
-		u_int16_t cell = vars[i].value;
+		if (vars[i].label) continue;
+		cells[cellcount++] = vars[i].value;
+	}
+
+	if (args.sparse) {
+		writeSparse(out, cells, cellcount);
+	} else for (size_t i = 0; i < cellcount; i++) {
+		u_int16_t cell = cells[i];
 
 		if (args.decimal) {
 			fprintf(out, "%i\n", cell);
@@ -405,6 +466,10 @@ int main (int argc, char **argv) {
 		}
 	}
 
+	if (args.metadata) {
+		writeMetadata(out, opers, opercount, vars, varcount, args.minecraft);
+	}
+
 	return EXIT_SUCCESS;
 
 	premature_eof_err:
@@ -423,11 +488,12 @@ int main (int argc, char **argv) {
 	fprintf (
 		stderr, "%s: ERR unknown opcode in %s\n",
 		argv[0], args.inPath);
+	return EXIT_FAILURE;
 
 	invalid_symbol_err:
 	fprintf (
-		stderr, "%s: ERR unknown symbol in %s\n",
-		argv[0], args.inPath);
+		stderr, "%s: ERR unknown symbol in %s: [%s]\n",
+		argv[0], args.inPath, badexpr);
 	return EXIT_FAILURE;
 }
 
@@ -441,3 +507,533 @@ int readVarName (FILE *src, int *ch, char *dest) {
 	}
 	return 0;
 }
+
+// readValue
+// Reads the value of a variable up to the next whitespace. Character literals
+// are read whole, so that they can hold a space. It returns 1 if the value is
+// too long to fit in dest.
+int readValue (FILE *src, int *ch, char *dest, size_t size) {
+	size_t i = 0;
+	dest[0] = 0;
+	while (*ch != EOF && *ch != ' ' && *ch != '\t' && *ch != '\n') {
+		int quoted = *ch == '\'';
+		for (int j = 0; j < (quoted ? 3 : 1); j++) {
+			if (*ch == EOF || *ch == '\n' || i + 1 >= size) return 1;
+			dest[i++] = (char)(*ch);
+			*ch = fgetc(src);
+		}
+		dest[i] = 0;
+	}
+	return 0;
+}
+
+// evalVar
+// Works out the value of a variable from its constant expression. Expressions
+// are terms added or subtracted from left to right. A term can be a hex number
+// starting with $, a character literal like 'A', &name for the address of a
+// variable or label, or name for the value of another variable. Names are
+// looked up before numbers, so a variable is never mistaken for one. A value
+// that is a single term naming nothing, and made of up to four hex digits, is
+// read the old way, with the first digit being the most significant of four.
+// In minecraft mode, character literals are converted to the minecraft
+// charset. It returns 1 if the expression is bad or refers to something that
+// doesn't exist.
+int evalVar (Var *var, Var *vars, size_t varcount, int minecraft) {
+	if (var->expr[0] == 0 || var->evaluated) return 0;
+	if (var->evaluating) return 1; // it refers to itself
+	var->evaluating = 1;
+
+	size_t digits = strspn(var->expr, "0123456789abcdefABCDEF");
+	if (
+		digits > 0 && digits <= 4 && var->expr[digits] == 0 &&
+		findVar(var->expr, vars, varcount) == NULL
+	) {
+		int mult = 4096;
+		var->value = 0;
+		for (size_t i = 0; i < digits; i++) {
+			int digit = var->expr[i];
+			if (digit <= 57) digit -= 48;
+			else if (digit <= 90) digit -= 55;
+			else digit -= 87;
+			var->value = (u_int16_t)(var->value + digit * mult);
+			mult /= 16;
+		}
+		var->evaluating = 0;
+		var->evaluated = 1;
+		return 0;
+	}
+
+	const char *at = var->expr;
+	long total = 0;
+	int sign = 1;
+	for (;;) {
+		// a term runs up to the next operator. an operator right at the
+		// start of a term belongs to it, like in a character literal.
+		size_t length = at[0] == '\'' ? 3 : 0;
+		length += strcspn(at + length, "+-");
+		if (length == 0) return 1;
+
+		long term;
+		if (evalTerm(at, length, vars, varcount, minecraft, &term)) return 1;
+		total += sign * term;
+
+		at += length;
+		if (*at == 0) break;
+		sign = *(at++) == '-' ? -1 : 1;
+	}
+
+	var->value = (u_int16_t)(total);
+	var->evaluating = 0;
+	var->evaluated = 1;
+	return 0;
+}
+
+// evalTerm
+// Works out the value of a single term of a constant expression.
+int evalTerm (
+	const char *term, size_t length, Var *vars, size_t varcount,
+	int minecraft, long *value
+) {
+	char name[16];
+	int address = term[0] == '&';
+
+	if (length == 3 && term[0] == '\'' && term[2] == '\'') {
+		int ch = (unsigned char)(term[1]);
+		if (minecraft) {
+			if (ch >= 'a' && ch <= 'z') ch -= 32;
+			ch = ch > 127 ? 0 : asciiToMc[ch];
+		}
+		*value = ch;
+		return 0;
+	}
+
+	if (length - (size_t)(address) >= sizeof(name)) return 1;
+	memcpy(name, term + address, length - (size_t)(address));
+	name[length - (size_t)(address)] = 0;
+	if (name[0] == 0) return 1;
+
+	Var *found = findVar(name, vars, varcount);
+	if (found != NULL) {
+		if (address) {
+			*value = found->addr;
+			return 0;
+		}
+		if (found->label) return 1;
+		if (evalVar(found, vars, varcount, minecraft)) return 1;
+		*value = found->value;
+		return 0;
+	}
+
+	size_t digits = strspn(name + 1, "0123456789abcdefABCDEF");
+	if (!address && name[0] == '$' && digits > 0 && name[digits + 1] == 0) {
+		*value = strtol(name + 1, NULL, 16);
+		return 0;
+	}
+	return 1;
+}
+
+// findVar
+// Returns the variable or label with the given name, or NULL if there is no
+// such thing.
+Var *findVar (const char *name, Var *vars, size_t varcount) {
+	for (size_t i = 0; i < varcount; i++) {
+		if (strcmp(name, vars[i].name) == 0) return &vars[i];
+	}
+	return NULL;
+}
+
+// preprocess
+// Reads a whole source file, expands its macros and repeat blocks, and returns
+// a stream of the result. The source file is closed. It returns NULL if the
+// source could not be expanded.
+FILE *preprocess (FILE *in) {
+	size_t length = 0, size = 4096;
+	char *text = malloc(size);
+	int ch;
+	while ((ch = fgetc(in)) != EOF) {
+		if (length + 1 >= size) {
+			size *= 2;
+			text = realloc(text, size);
+		}
+		text[length++] = (char)(ch);
+	}
+	text[length] = 0;
+	fclose(in);
+
+	char *result = NULL;
+	size_t resultLength = 0;
+	FILE *out = open_memstream(&result, &resultLength);
+	if (out == NULL) return NULL;
+	int err = expandText(text, out, 0);
+	fclose(out);
+	free(text);
+	if (err) return NULL;
+
+	return fmemopen(result, resultLength, "r");
+}
+
+// expandText
+// Expands macros and repeat blocks in text, writing the result to out. Lines
+// are handled like this:
+//   %macro name params...   starts a macro definition, up to %end
+//   %rep count [counter]    repeats the lines up to %end count times
+//   name args...            expands a macro that was defined before
+// In the body of a macro, {param} is replaced by the argument given for it.
+// In the body of a repeat block, {counter} is replaced by the number of the
+// repetition as four hex digits. In both, @name is replaced by a label name
+// that is unique to each expansion. Counts are hex. It returns 1 on error.
+int expandText (const char *text, FILE *out, int depth) {
+	if (depth > MACRO_DEPTH) {
+		fputs("ERR macros are nested too deeply\n", stderr);
+		return 1;
+	}
+
+	while (*text != 0) {
+		const char *next = strchr(text, '\n');
+		next = next == NULL ? text + strlen(text) : next + 1;
+
+		size_t length = (size_t)(next - text);
+
+		// most lines are passed through untouched, so only lines that
+		// start with a directive or a macro name get split into words
+		const char *first = text + strspn(text, " \t");
+		size_t firstLength = strcspn(first, " \t\r\n");
+		Macro *macro = NULL;
+		for (size_t i = 0; firstLength > 0 && i < macrocount; i++) {
+			if (
+				strlen(macros[i].name) == firstLength &&
+				strncmp(first, macros[i].name, firstLength) == 0
+			) {
+				macro = &macros[i];
+			}
+		}
+		if (macro == NULL && (firstLength == 0 || first[0] != '%')) {
+			fwrite(text, 1, length, out);
+			text = next;
+			continue;
+		}
+
+		char *line = strndup(text, length);
+		char words[MACRO_PARAMS + 2][WORD_SIZE];
+		int wordcount = 0;
+		for (char *word = strtok(line, " \t\r\n");
+			word != NULL && wordcount < MACRO_PARAMS + 2;
+			word = strtok(NULL, " \t\r\n")) {
+			snprintf(words[wordcount++], sizeof(words[0]), "%s", word);
+		}
+		free(line);
+
+		if (strcmp(words[0], "%macro") == 0) {
+			// define a macro
+			if (wordcount < 2) {
+				fputs("ERR macro has no name\n", stderr);
+				return 1;
+			}
+			const char *end;
+			const char *after = findBlockEnd(next, &end);
+			if (after == NULL) return 1;
+
+			if (macrocount >= macrosize) {
+				macrosize = macrosize == 0 ? 8 : macrosize * 2;
+				macros = realloc(macros, macrosize * sizeof(Macro));
+			}
+			Macro *new = &macros[macrocount++];
+			strncpy(new->name, words[1], sizeof(new->name) - 1);
+			new->name[sizeof(new->name) - 1] = 0;
+			new->paramcount = wordcount - 2;
+			for (int i = 0; i < new->paramcount; i++) {
+				strcpy(new->params[i], words[i + 2]);
+			}
+			new->body = strndup(next, (size_t)(end - next));
+			next = after;
+		} else if (strcmp(words[0], "%rep") == 0) {
+			// repeat a block
+			const char *end;
+			const char *after = findBlockEnd(next, &end);
+			if (after == NULL) return 1;
+			if (wordcount < 2) {
+				fputs("ERR repeat block has no count\n", stderr);
+				return 1;
+			}
+
+			char *countEnd;
+			long count = strtol(words[1], &countEnd, 16);
+			if (*countEnd != 0 || words[1][0] == '-' || count < 0) {
+				fprintf (
+					stderr, "ERR repeat count %s is not a hex number\n",
+					words[1]);
+				return 1;
+			}
+
+			char *body = strndup(next, (size_t)(end - next));
+			for (long i = 0; i < count; i++) {
+				char counter[1][WORD_SIZE];
+				snprintf (
+					counter[0], sizeof(counter[0]), "%04x",
+					(unsigned int)(i & 0xFFFF));
+				char *expanded = substitute (
+					body, words + 2, counter, wordcount > 2,
+					(int)(++expansions));
+				int err = expanded == NULL ||
+					expandText(expanded, out, depth + 1);
+				free(expanded);
+				if (err) return 1;
+			}
+			free(body);
+			next = after;
+		} else if (strcmp(words[0], "%end") == 0) {
+			fputs("ERR %end without a block to end\n", stderr);
+			return 1;
+		} else if (macro != NULL) {
+			// expand a macro
+			if (wordcount - 1 != macro->paramcount) {
+				fprintf (
+					stderr, "ERR macro %s takes %i args\n",
+					macro->name, macro->paramcount);
+				return 1;
+			}
+			char *expanded = substitute (
+				macro->body, macro->params, words + 1,
+				macro->paramcount, (int)(++expansions));
+			int err = expanded == NULL ||
+				expandText(expanded, out, depth + 1);
+			free(expanded);
+			if (err) return 1;
+		} else {
+			fwrite(text, 1, length, out);
+		}
+
+		text = next;
+	}
+
+	return 0;
+}
+
+// findBlockEnd
+// Finds the %end that closes a block whose body starts at text, skipping over
+// any blocks nested inside it. The end of the body is stored in end, and the
+// line after the %end is returned. It returns NULL if there is no %end.
+const char *findBlockEnd (const char *text, const char **end) {
+	int nesting = 0;
+	while (*text != 0) {
+		const char *next = strchr(text, '\n');
+		next = next == NULL ? text + strlen(text) : next + 1;
+
+		const char *word = text + strspn(text, " \t");
+		if (strncmp(word, "%macro", 6) == 0 || strncmp(word, "%rep", 4) == 0) {
+			nesting++;
+		} else if (strncmp(word, "%end", 4) == 0 && nesting-- == 0) {
+			*end = text;
+			return next;
+		}
+		text = next;
+	}
+
+	fputs("ERR block is missing its %end\n", stderr);
+	return NULL;
+}
+
+// substitute
+// Makes a copy of body with each {name} replaced by its value, and each @name
+// replaced by name_id. Only an @ that starts a word makes a local label, and
+// character literals and comment lines are copied as they are. It returns NULL
+// if a local label name gets too long.
+char *substitute (
+	const char *body, char (*names)[WORD_SIZE], char (*values)[WORD_SIZE],
+	int count,
+	int id
+) {
+	char *result = NULL;
+	size_t length = 0;
+	FILE *out = open_memstream(&result, &length);
+	if (out == NULL) return NULL;
+
+	const char *start = body;
+	int lineStart = 1;
+	while (*body != 0) {
+		char previous = body == start ? ' ' : body[-1];
+		if (*body == '\n') {
+			lineStart = 1;
+		} else if (*body != ' ' && *body != '\t') {
+			if (lineStart && *body == '#') {
+				size_t lineLength = strcspn(body, "\n");
+				fwrite(body, 1, lineLength, out);
+				body += lineLength;
+				continue;
+			}
+			lineStart = 0;
+		}
+
+		if (*body == '\'' && body[1] != 0 && body[2] == '\'') {
+			fwrite(body, 1, 3, out);
+			body += 3;
+			continue;
+		} else if (*body == '{') {
+			const char *close = strchr(body, '}');
+			int found = 0;
+			for (int i = 0; close != NULL && i < count; i++) {
+				size_t nameLength = strlen(names[i]);
+				if (
+					(size_t)(close - body - 1) == nameLength &&
+					strncmp(body + 1, names[i], nameLength) == 0
+				) {
+					fputs(values[i], out);
+					body = close + 1;
+					found = 1;
+					break;
+				}
+			}
+			if (found) continue;
+		} else if (*body == '@' && strchr(" \t\r\n+-&", previous) != NULL) {
+			size_t nameLength = strcspn(body + 1, " \t\r\n+-");
+			int labelLength = fprintf (
+				out, "%.*s_%i", (int)(nameLength), body + 1, id);
+			if (labelLength > 15) {
+				fprintf (
+					stderr, "ERR local label %.*s is too long\n",
+					(int)(nameLength), body + 1);
+				fclose(out);
+				free(result);
+				return NULL;
+			}
+			body += nameLength + 1;
+			continue;
+		}
+		fputc(*(body++), out);
+	}
+
+	fclose(out);
+	return result;
+}
+
+// writeSparse
+// Writes cells as a sparse image. Zero cells are skipped, runs of at least
+// four identical cells are written as a single repeated cell, and everything
+// else is written literally. See loader.h for the layout.
+void writeSparse (FILE *out, const u_int16_t *cells, size_t count) {
+	fputs("BKRL", out);
+
+	size_t i = 0;
+	while (i < count) {
+		if (cells[i] == 0) { i++; continue; }
+
+		// measure the run starting here
+		size_t run = 1;
+		while (i + run < count && cells[i + run] == cells[i]) run++;
+
+		size_t length = run;
+		u_int16_t header = (u_int16_t)(run) | 0x8000;
+		if (run < 4) {
+			// carry on until a zero or a run worth repeating
+			length = 0;
+			while (i + length < count && cells[i + length] != 0) {
+				size_t ahead = 1;
+				while (
+					i + length + ahead < count &&
+					cells[i + length + ahead] == cells[i + length]
+				) ahead++;
+				if (ahead >= 4) break;
+				length += ahead;
+			}
+			header = (u_int16_t)(length);
+		}
+
+		fputc(i >> 8, out);
+		fputc(i & 0xFF, out);
+		fputc(header >> 8, out);
+		fputc(header & 0xFF, out);
+		for (size_t j = 0; j < (header & 0x8000 ? 1 : length); j++) {
+			fputc(cells[i + j] >> 8, out);
+			fputc(cells[i + j] & 0xFF, out);
+		}
+		i += length;
+	}
+}
+
+// writeMetadata
+// Writes a metadata section describing the program, so that bookcpu doesn't
+// have to work it out at load time. Everything is big-endian. The section
+// starts with "BKMD", a version, the number of code cells and the number of
+// data cells after them. Then come three counted lists of addresses: cells
+// that start a basic block, cells that are jumped to, and variables that are
+// initialized as pointers. Then comes a counted list of symbols, each with an
+// address, a kind (0 for labels and 1 for variables), the length of its name,
+// and the name. The section ends with its length, not counting this footer,
+// and "BKMD" again, so it can be found from the end of the file.
+void writeMetadata (
+	FILE *out, Oper *opers, size_t opercount, Var *vars, size_t varcount,
+	int minecraft
+) {
+	u_int8_t leader[MEM_SIZE] = { 0 }, target[MEM_SIZE] = { 0 };
+	long start = ftell(out);
+
+	// a block starts at the beginning, at every label and jump target, and
+	// after every jump
+	leader[0] = 1;
+	for (size_t i = 0; i < varcount; i++) {
+		if (vars[i].label && vars[i].addr < MEM_SIZE) leader[vars[i].addr] = 1;
+	}
+	for (size_t i = 0; i < opercount; i++) {
+		u_int8_t opcode = opers[i].opcode;
+		int jump = minecraft ? opcode >= 0xb : opcode >= 0x8 && opcode <= 0xc;
+		int halt = !minecraft && opcode == 0xf;
+		if (!jump && !halt) continue;
+
+		if (i + 1 < MEM_SIZE) leader[i + 1] = 1;
+		if (jump && opers[i].addr < 0xFFE) {
+			leader[opers[i].addr] = 1;
+			target[opers[i].addr] = 1;
+		}
+	}
+
+	size_t datacount = 0, leadercount = 0, targetcount = 0, pointercount = 0;
+	size_t symbolcount = 0;
+	for (size_t i = 0; i < varcount; i++) {
+		if (!vars[i].label) datacount++;
+		if (!vars[i].label && vars[i].expr[0] == '&') pointercount++;
+		if (vars[i].name[0] != 0) symbolcount++;
+	}
+	for (size_t i = 0; i < MEM_SIZE; i++) {
+		leadercount += leader[i];
+		targetcount += target[i];
+	}
+
+	fputs("BKMD", out);
+	writeWord(out, 1);
+	writeWord(out, (u_int16_t)(opercount));
+	writeWord(out, (u_int16_t)(datacount));
+
+	writeWord(out, (u_int16_t)(leadercount));
+	for (u_int16_t i = 0; i < MEM_SIZE; i++) if (leader[i]) writeWord(out, i);
+	writeWord(out, (u_int16_t)(targetcount));
+	for (u_int16_t i = 0; i < MEM_SIZE; i++) if (target[i]) writeWord(out, i);
+
+	writeWord(out, (u_int16_t)(pointercount));
+	for (size_t i = 0; i < varcount; i++) {
+		if (!vars[i].label && vars[i].expr[0] == '&') {
+			writeWord(out, vars[i].addr);
+		}
+	}
+
+	writeWord(out, (u_int16_t)(symbolcount));
+	for (size_t i = 0; i < varcount; i++) {
+		size_t length = strlen(vars[i].name);
+		if (length == 0) continue;
+		writeWord(out, vars[i].addr);
+		fputc(vars[i].label ? 0 : 1, out);
+		fputc((int)(length), out);
+		fputs(vars[i].name, out);
+	}
+
+	unsigned long length = (unsigned long)(ftell(out) - start);
+	writeWord(out, (u_int16_t)(length >> 16));
+	writeWord(out, (u_int16_t)(length & 0xFFFF));
+	fputs("BKMD", out);
+}
+
+// writeWord
+// Writes a big-endian 16 bit number.
+void writeWord (FILE *out, u_int16_t word) {
+	fputc(word >> 8, out);
+	fputc(word & 0xFF, out);
+}
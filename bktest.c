@@ -0,0 +1,526 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+// test outcomes
+#define TEST_PASS  0
+#define TEST_FAIL  1
+#define TEST_ERROR 2
+
+// test
+// This struct stores one test that was found, and what happened when it ran.
+// A test is made up of an expected output file ending in .out, a program to
+// run that is either a .bkasm source file or an image with no extension, and
+// an optional .in file that is fed to the program as input. Tests whose names
+// end in -mc are run with the minecraft instruction set. If there is a .fail
+// file, the image is bad, and the test passes if bookcpu refuses to load it.
+// If there is a .meta file, the program is assembled with a metadata section,
+// and the timing report that bookcpu works out from it must match the file.
+typedef struct test {
+	int minecraft;
+	int assemble;
+	int outcome;
+	int reject;
+	int metadata;
+	int PADDING; // delete this if another 4 bytes are added
+	double seconds;
+	char name[256];
+	char program[256];
+	char input[256];
+	char expected[256];
+	char timing[256];
+	char message[128];
+} Test;
+
+// options
+// This struct stores information about how the user wants to run the tests.
+static struct {
+	int quiet;
+	int help;
+	int jobs;
+	int dircount;
+	char *limit;
+	char *bin;
+	char *report;
+	char **dirs;
+} options = { 0 };
+
+static size_t testcount = 0, testsize = 0;
+static Test *tests = NULL;
+
+int  findTests    (const char*);
+int  compareTests (const void*, const void*);
+void addTest      (const char*);
+void runTest      (Test*);
+int  runProgram   (char* const*, const char*, const char*, const char*);
+void compareFiles (Test*, const char*, const char*, const char*);
+int  writeReport  (const char*, double);
+void writeEscaped (FILE*, const char*);
+int  fileExists   (const char*);
+double secondsSince (struct timespec*);
+
+int main (int argc, char **argv) {
+	options.dirs = malloc((size_t)(argc) * sizeof(char *));
+
+	for (int i = 1, getSwitches = 1; i < argc; i++) {
+		char *ch = argv[i];
+		if (*ch == '-' && getSwitches) {
+			// this arg has 1 or more switches
+			while (*(++ch) != 0) switch (*ch) {
+			case '-': getSwitches  = 0; break;
+			case 'q': options.quiet = 1; break;
+			case 'h': options.help  = 1; break;
+			case 'j':
+				if (i + 1 < argc) options.jobs = atoi(argv[++i]);
+				break;
+			case 'n':
+				if (i + 1 < argc) options.limit = argv[++i];
+				break;
+			case 'b':
+				if (i + 1 < argc) options.bin = argv[++i];
+				break;
+			case 'r':
+				if (i + 1 < argc) options.report = argv[++i];
+				break;
+			}
+		}
+		// we have a directory
+		else options.dirs[options.dircount++] = ch;
+	}
+
+	if (options.help) {
+		printf("Usage: %s [options] [directories]\n", argv[0]);
+		puts("Options:");
+		puts("  -j    Number of tests to run at once (default all cores)");
+		puts("  -n    Instruction limit for each test (default 1000000)");
+		puts("  -b    Directory holding bookcpu and bkasm (default bin)");
+		puts("  -r    Write a JUnit report to the file in the next arg");
+		puts("  -q    Only print failures and the summary");
+		puts("  -h    Show help");
+		return EXIT_SUCCESS;
+	}
+
+	if (options.dircount == 0) options.dirs[options.dircount++] = ".";
+	if (options.bin   == NULL) options.bin   = "bin";
+	if (options.limit == NULL) options.limit = "1000000";
+	if (
+		strspn(options.limit, "0123456789") != strlen(options.limit) ||
+		strtoull(options.limit, NULL, 10) == 0
+	) {
+		fprintf (
+			stderr, "%s: ERR instruction limit must be a positive number\n",
+			argv[0]);
+		return EXIT_FAILURE;
+	}
+	if (options.jobs < 1) {
+		options.jobs = (int)(sysconf(_SC_NPROCESSORS_ONLN));
+		if (options.jobs < 1) options.jobs = 1;
+	}
+
+	for (int i = 0; i < options.dircount; i++) {
+		if (findTests(options.dirs[i])) {
+			fprintf (
+				stderr, "%s: ERR could not read directory %s\n",
+				argv[0], options.dirs[i]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (testcount == 0) {
+		fprintf(stderr, "%s: ERR no tests found\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	qsort(tests, testcount, sizeof(Test), compareTests);
+
+	// the tests are shared with the workers, so that they can fill in the
+	// results. the next free test is handed out through a shared counter.
+	Test *shared = mmap (
+		NULL, testcount * sizeof(Test) + sizeof(size_t),
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shared == MAP_FAILED) {
+		perror("ERR could not map shared memory");
+		return EXIT_FAILURE;
+	}
+	memcpy(shared, tests, testcount * sizeof(Test));
+	free(tests);
+	tests = shared;
+	size_t *next = (size_t *)(&tests[testcount]);
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	fflush(stdout);
+
+	int workers = 0, crashed = 0, status;
+	for (int i = 0; i < options.jobs; i++) {
+		pid_t pid = fork();
+		if (pid == 0) {
+			size_t index;
+			while ((index = __atomic_fetch_add(next, 1, __ATOMIC_SEQ_CST))
+				< testcount) {
+				runTest(&tests[index]);
+			}
+			_exit(EXIT_SUCCESS);
+		} else if (pid < 0) {
+			perror("ERR could not fork worker");
+			break;
+		}
+		workers++;
+	}
+	if (workers == 0) {
+		fprintf(stderr, "%s: ERR no workers could be started\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	// a worker that died leaves its tests marked as not run, but it still
+	// fails the run in case it died after storing an outcome
+	while (wait(&status) > 0) {
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+			crashed++;
+		}
+	}
+	if (crashed > 0) {
+		fprintf (
+			stderr, "%s: ERR %i worker%s died while running tests\n",
+			argv[0], crashed, crashed == 1 ? "" : "s");
+	}
+
+	double seconds = secondsSince(&start);
+
+	// print results
+	size_t failures = 0;
+	for (size_t i = 0; i < testcount; i++) {
+		Test *test = &tests[i];
+		if (test->outcome != TEST_PASS) {
+			failures++;
+		} else if (options.quiet) {
+			continue;
+		}
+		printf (
+			"%s\t%s\t%.3fs\t%s\n",
+			test->outcome == TEST_PASS ? "PASS" :
+			test->outcome == TEST_FAIL ? "FAIL" : "ERROR",
+			test->name, test->seconds, test->message);
+	}
+	printf (
+		"%s: %zu passed, %zu failed, %zu total in %.3fs\n",
+		argv[0], testcount - failures, failures, testcount, seconds);
+
+	if (options.report != NULL && writeReport(options.report, seconds)) {
+		fprintf (
+			stderr, "%s: ERR could not open file %s\n",
+			argv[0], options.report);
+		return EXIT_FAILURE;
+	}
+
+	return failures == 0 && crashed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// findTests
+// Searches a directory and all of its subdirectories for tests. On success, it
+// returns 0. If the directory could not be read, it returns 1.
+int findTests (const char *dir) {
+	DIR *handle = opendir(dir);
+	if (handle == NULL) return 1;
+
+	struct dirent *entry;
+	while ((entry = readdir(handle)) != NULL) {
+		char path[256];
+		char *name = entry->d_name;
+		if (name[0] == '.') continue;
+		if (snprintf(path, sizeof(path), "%s/%s", dir, name)
+			>= (int)(sizeof(path))) continue;
+
+		struct stat info;
+		if (stat(path, &info)) continue;
+		if (S_ISDIR(info.st_mode)) {
+			findTests(path);
+			continue;
+		}
+
+		size_t length = strlen(name);
+		if (length > 4 && strcmp(name + length - 4, ".out") == 0) {
+			path[strlen(path) - 4] = 0;
+			addTest(path);
+		}
+	}
+
+	closedir(handle);
+	return 0;
+}
+
+// compareTests
+// Orders tests by name, so that results are always reported in the same order.
+int compareTests (const void *a, const void *b) {
+	return strcmp(((const Test *)(a))->name, ((const Test *)(b))->name);
+}
+
+// addTest
+// Adds the test at base, which is the path of its .out file without the
+// extension. If there is no program to go along with it, the test is still
+// added, so that it gets reported as an error.
+void addTest (const char *base) {
+	if (testcount >= testsize) {
+		testsize = testsize == 0 ? 64 : testsize * 2;
+		tests = realloc(tests, testsize * sizeof(Test));
+	}
+	Test *test = &tests[testcount++];
+	memset(test, 0, sizeof(Test));
+
+	// a test only counts as passed once it has actually been run
+	test->outcome = TEST_ERROR;
+	strcpy(test->message, "not run");
+
+	snprintf(test->name,     sizeof(test->name),     "%s", base);
+	snprintf(test->expected, sizeof(test->expected), "%s.out", base);
+	snprintf(test->input,    sizeof(test->input),    "%s.in", base);
+	if (!fileExists(test->input)) strcpy(test->input, "/dev/null");
+
+	snprintf(test->program, sizeof(test->program), "%s.bkasm", base);
+	test->assemble = fileExists(test->program);
+	if (!test->assemble) {
+		snprintf(test->program, sizeof(test->program), "%s", base);
+	}
+
+	char marker[256];
+	snprintf(marker, sizeof(marker), "%s.fail", base);
+	test->reject = fileExists(marker);
+	snprintf(test->timing, sizeof(test->timing), "%s.meta", base);
+	test->metadata = fileExists(test->timing);
+
+	size_t length = strlen(base);
+	test->minecraft = length > 3 && strcmp(base + length - 3, "-mc") == 0;
+}
+
+// runTest
+// Assembles the program of a test if it needs to be, runs it, and compares its
+// output against what is expected. The outcome is stored in the test.
+void runTest (Test *test) {
+	char image[]  = "/tmp/bktest-image-XXXXXX";
+	char output[] = "/tmp/bktest-output-XXXXXX";
+	char errput[] = "/tmp/bktest-errput-XXXXXX";
+	char bkasm[256], bookcpu[256];
+	char *mode = test->minecraft ? "-m" : "--";
+	int status;
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	strcpy(test->message, "did not finish");
+
+	snprintf(bkasm,   sizeof(bkasm),   "%s/bkasm",   options.bin);
+	snprintf(bookcpu, sizeof(bookcpu), "%s/bookcpu", options.bin);
+
+	int imageFd  = mkstemp(image);
+	int outputFd = mkstemp(output);
+	int errputFd = mkstemp(errput);
+	if (imageFd < 0 || outputFd < 0 || errputFd < 0) {
+		test->outcome = TEST_ERROR;
+		strcpy(test->message, "could not create temporary files");
+		goto cleanup;
+	}
+
+	char *program = test->program;
+	if (test->assemble) {
+		char *asmArgs[] = {
+			bkasm, "-q", test->metadata ? "-e" : "-q", mode,
+			test->program, image, NULL
+		};
+		if (runProgram(asmArgs, "/dev/null", "/dev/null", "/dev/null")) {
+			test->outcome = TEST_ERROR;
+			strcpy(test->message, "could not assemble program");
+			goto cleanup;
+		}
+		program = image;
+	} else if (!fileExists(program)) {
+		test->outcome = TEST_ERROR;
+		strcpy(test->message, "no program to run");
+		goto cleanup;
+	}
+
+	// the timing report is worked out from the metadata, so it shows whether
+	// its symbols and basic blocks were loaded
+	char *runArgs[] = {
+		bookcpu, "-n", options.limit, mode, program, NULL, NULL, NULL
+	};
+	if (test->metadata) {
+		runArgs[3] = "-t";
+		runArgs[4] = "-";
+		runArgs[5] = mode;
+		runArgs[6] = program;
+	}
+	status = runProgram(runArgs, test->input, output, errput);
+	if (test->reject) {
+		if (status == 1) {
+			compareFiles(test, output, test->expected, "output");
+		} else {
+			test->outcome = TEST_FAIL;
+			snprintf (
+				test->message, sizeof(test->message),
+				"bad image was not rejected, exit status %i", status);
+		}
+	} else if (status == 2) {
+		test->outcome = TEST_FAIL;
+		snprintf (
+			test->message, sizeof(test->message),
+			"instruction limit of %s reached", options.limit);
+	} else if (status != 0) {
+		test->outcome = TEST_ERROR;
+		snprintf (
+			test->message, sizeof(test->message),
+			"bookcpu exited with status %i", status);
+	} else {
+		compareFiles(test, output, test->expected, "output");
+		if (test->outcome == TEST_PASS && test->metadata) {
+			compareFiles(test, errput, test->timing, "timing report");
+		}
+	}
+
+	cleanup:
+	if (imageFd  >= 0) { close(imageFd);  unlink(image);  }
+	if (outputFd >= 0) { close(outputFd); unlink(output); }
+	if (errputFd >= 0) { close(errputFd); unlink(errput); }
+	test->seconds = secondsSince(&start);
+}
+
+// runProgram
+// Runs a program with its input, output, and error output redirected to files,
+// and waits for it to finish. It returns the exit status of the program, or -1
+// if it could not be run.
+int runProgram (
+	char * const *args, const char *input, const char *output,
+	const char *errput
+) {
+	pid_t pid = fork();
+	if (pid < 0) return -1;
+
+	if (pid == 0) {
+		int in  = open(input, O_RDONLY);
+		int out = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+		int err = open(errput, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+		if (in < 0 || out < 0 || err < 0) _exit(127);
+		dup2(in, 0);
+		dup2(out, 1);
+		dup2(err, 2);
+		execv(args[0], args);
+		_exit(127);
+	}
+
+	int status;
+	if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status)) return -1;
+	return WEXITSTATUS(status);
+}
+
+// compareFiles
+// Compares something a test wrote byte for byte against the file holding what
+// is expected, and stores the outcome in the test. what names it in messages.
+void compareFiles (
+	Test *test, const char *output, const char *expected, const char *what
+) {
+	FILE *got  = fopen(output, "r");
+	FILE *want = fopen(expected, "r");
+	if (got == NULL || want == NULL) {
+		test->outcome = TEST_ERROR;
+		snprintf (
+			test->message, sizeof(test->message),
+			"could not read %s", what);
+	} else {
+		long offset = 0;
+		int a, b;
+		do {
+			a = fgetc(got);
+			b = fgetc(want);
+			offset++;
+		} while (a == b && a != EOF);
+
+		if (a == b) {
+			test->outcome = TEST_PASS;
+			test->message[0] = 0;
+		} else {
+			test->outcome = TEST_FAIL;
+			snprintf (
+				test->message, sizeof(test->message),
+				"%s differs at byte %li", what, offset - 1);
+		}
+	}
+
+	if (got  != NULL) fclose(got);
+	if (want != NULL) fclose(want);
+}
+
+// writeReport
+// Writes the results of all tests as a JUnit XML report. On success, it
+// returns 0. If the file could not be opened, it returns 1.
+int writeReport (const char *path, double seconds) {
+	FILE *out = fopen(path, "w");
+	if (out == NULL) return 1;
+
+	size_t failures = 0, errors = 0;
+	for (size_t i = 0; i < testcount; i++) {
+		if (tests[i].outcome == TEST_FAIL)  failures++;
+		if (tests[i].outcome == TEST_ERROR) errors++;
+	}
+
+	fputs("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n", out);
+	fprintf (
+		out,
+		"<testsuite name=\"bookcpu\" tests=\"%zu\" failures=\"%zu\" "
+		"errors=\"%zu\" time=\"%.3f\">\n",
+		testcount, failures, errors, seconds);
+
+	for (size_t i = 0; i < testcount; i++) {
+		Test *test = &tests[i];
+		fputs("  <testcase classname=\"bookcpu\" name=\"", out);
+		writeEscaped(out, test->name);
+		fprintf(out, "\" time=\"%.3f\"", test->seconds);
+
+		if (test->outcome == TEST_PASS) {
+			fputs("/>\n", out);
+			continue;
+		}
+
+		fprintf (
+			out, ">\n    <%s message=\"",
+			test->outcome == TEST_FAIL ? "failure" : "error");
+		writeEscaped(out, test->message);
+		fprintf (
+			out, "\"/>\n  </testcase>\n");
+	}
+
+	fputs("</testsuite>\n", out);
+	fclose(out);
+	return 0;
+}
+
+// writeEscaped
+// Writes a string with the characters that are special in XML escaped.
+void writeEscaped (FILE *out, const char *str) {
+	for (; *str != 0; str++) switch (*str) {
+	case '&':  fputs("&amp;",  out); break;
+	case '<':  fputs("&lt;",   out); break;
+	case '>':  fputs("&gt;",   out); break;
+	case '"':  fputs("&quot;", out); break;
+	default:   fputc(*str,     out); break;
+	}
+}
+
+// fileExists
+// Returns 1 if there is a regular file at path, and 0 if there isn't.
+int fileExists (const char *path) {
+	struct stat info;
+	return stat(path, &info) == 0 && S_ISREG(info.st_mode);
+}
+
+// secondsSince
+// Returns how many seconds have passed since the given time.
+double secondsSince (struct timespec *start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (double)(now.tv_sec - start->tv_sec) +
+		(double)(now.tv_nsec - start->tv_nsec) / 1e9;
+}
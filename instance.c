@@ -0,0 +1,184 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "instance.h"
+
+// the index of each dirty chunk comes first, padded so that the cells after it
+// stay aligned
+#define INDEX_SIZE(count) (((count) + 1) & ~(size_t)(1))
+
+static size_t dirtySize (u_int16_t);
+
+// imageShare
+// Makes a new shared image out of a memory array. The caller holds the only
+// reference to it.
+Image *imageShare (const u_int16_t *memory) {
+	Image *image = malloc(sizeof(Image));
+	if (image == NULL) { return NULL; }
+	image->refs = 1;
+	memcpy(image->cells, memory, sizeof(image->cells));
+	return image;
+}
+
+// imageRetain
+// Adds a reference to an image.
+void imageRetain (Image *image) {
+	image->refs++;
+}
+
+// imageRelease
+// Drops a reference to an image, freeing it if it was the last one.
+void imageRelease (Image *image) {
+	if (--image->refs == 0) { free(image); }
+}
+
+// arenaNew
+// Makes a new, empty arena.
+Arena *arenaNew (void) {
+	return calloc(1, sizeof(Arena));
+}
+
+// arenaAlloc
+// Allocates size bytes from an arena. Freed memory of the same size class is
+// reused first. It returns NULL if the size is too big or there is no memory
+// left.
+void *arenaAlloc (Arena *arena, size_t size) {
+	size_t class = (size + ARENA_ALIGN - 1) / ARENA_ALIGN;
+	if (class == 0) { class = 1; }
+	size = class * ARENA_ALIGN;
+	if (size > ARENA_BLOCK - ARENA_ALIGN) { return NULL; }
+
+	void *chunk = arena->free[class];
+	if (chunk != NULL) {
+		arena->free[class] = *(void **)(chunk);
+		return chunk;
+	}
+
+	// start a new block. the first few bytes of each block point to the
+	// one before it, so that they can all be found when destroying.
+	if (arena->block == NULL || arena->used + size > ARENA_BLOCK) {
+		char *block = malloc(ARENA_BLOCK);
+		if (block == NULL) { return NULL; }
+		*(char **)(block) = arena->block;
+		arena->block = block;
+		arena->used  = ARENA_ALIGN;
+	}
+
+	chunk = arena->block + arena->used;
+	arena->used += size;
+	return chunk;
+}
+
+// arenaFree
+// Gives memory that was allocated with size bytes back to an arena.
+void arenaFree (Arena *arena, void *chunk, size_t size) {
+	if (chunk == NULL) { return; }
+	size_t class = (size + ARENA_ALIGN - 1) / ARENA_ALIGN;
+	if (class == 0) { class = 1; }
+	*(void **)(chunk) = arena->free[class];
+	arena->free[class] = chunk;
+}
+
+// arenaDestroy
+// Frees an arena along with everything that was allocated from it.
+void arenaDestroy (Arena *arena) {
+	char *block = arena->block;
+	while (block != NULL) {
+		char *previous = *(char **)(block);
+		free(block);
+		block = previous;
+	}
+	free(arena);
+}
+
+// instanceNew
+// Allocates an instance from an arena, starting out with the memory of image
+// and everything else zeroed. The instance takes a reference to the image.
+Instance *instanceNew (Arena *arena, Image *image) {
+	Instance *instance = arenaAlloc(arena, sizeof(Instance));
+	if (instance == NULL) { return NULL; }
+	memset(instance, 0, sizeof(Instance));
+	instance->image = image;
+	imageRetain(image);
+	return instance;
+}
+
+// instanceSave
+// Stores the chunks of memory that differ from the image of an instance,
+// replacing whatever it had stored before. Registers and flags are set on the
+// instance directly by the caller. On success, it returns 0. If there was no
+// memory left, it returns 1, and the instance is left as it was.
+int instanceSave (Arena *arena, Instance *instance, const u_int16_t *memory) {
+	u_int8_t index[CHUNK_COUNT];
+	u_int16_t count = 0;
+	const u_int16_t *cells = instance->image->cells;
+
+	for (int i = 0; i < CHUNK_COUNT; i++) {
+		size_t offset = (size_t)(i) * CHUNK_SIZE;
+		if (memcmp(
+			memory + offset, cells + offset,
+			CHUNK_SIZE * sizeof(u_int16_t)
+		)) {
+			index[count++] = (u_int8_t)(i);
+		}
+	}
+
+	void *dirty = NULL;
+	if (count > 0) {
+		dirty = arenaAlloc(arena, dirtySize(count));
+		if (dirty == NULL) { return 1; }
+
+		u_int16_t *chunks = (u_int16_t *)((u_int8_t *)(dirty) +
+			INDEX_SIZE(count));
+		memcpy(dirty, index, count);
+		for (u_int16_t i = 0; i < count; i++) {
+			memcpy (
+				chunks + i * CHUNK_SIZE,
+				memory + index[i] * CHUNK_SIZE,
+				CHUNK_SIZE * sizeof(u_int16_t));
+		}
+	}
+
+	arenaFree(arena, instance->dirty, dirtySize(instance->dirtycount));
+	instance->dirty      = dirty;
+	instance->dirtycount = count;
+	return 0;
+}
+
+// instanceLoad
+// Expands an instance back out into a full memory array.
+void instanceLoad (const Instance *instance, u_int16_t *memory) {
+	const u_int8_t *index = instance->dirty;
+	const u_int16_t *chunks = (const u_int16_t *)(index +
+		INDEX_SIZE(instance->dirtycount));
+
+	memcpy(memory, instance->image->cells, MEM_SIZE * sizeof(u_int16_t));
+	for (u_int16_t i = 0; i < instance->dirtycount; i++) {
+		memcpy (
+			memory + index[i] * CHUNK_SIZE,
+			chunks + i * CHUNK_SIZE,
+			CHUNK_SIZE * sizeof(u_int16_t));
+	}
+}
+
+// instanceSize
+// Returns how many bytes an instance takes up, not counting its shared image.
+size_t instanceSize (const Instance *instance) {
+	return sizeof(Instance) + dirtySize(instance->dirtycount);
+}
+
+// instanceDelete
+// Gives an instance and its dirty chunks back to the arena, and drops its
+// reference to its image.
+void instanceDelete (Arena *arena, Instance *instance) {
+	arenaFree(arena, instance->dirty, dirtySize(instance->dirtycount));
+	imageRelease(instance->image);
+	arenaFree(arena, instance, sizeof(Instance));
+}
+
+// dirtySize
+// Returns how many bytes the dirty chunks of an instance take up.
+static size_t dirtySize (u_int16_t count) {
+	if (count == 0) { return 0; }
+	return INDEX_SIZE(count) + (size_t)(count) * CHUNK_SIZE * sizeof(u_int16_t);
+}
@@ -0,0 +1,70 @@
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#include <sys/types.h>
+
+// amount of 16 bit memory cells
+#ifndef MEM_SIZE
+#define MEM_SIZE 4096
+#endif
+
+// cells per copy-on-write chunk
+#define CHUNK_SIZE  16
+#define CHUNK_COUNT (MEM_SIZE / CHUNK_SIZE)
+
+// size of the blocks an arena takes from the system, and the granularity that
+// allocations are rounded up to
+#define ARENA_BLOCK 65536
+#define ARENA_ALIGN 16
+
+// packed machine flags
+#define FLAG_GT 0x1
+#define FLAG_EQ 0x2
+#define FLAG_LT 0x4
+
+// image
+// A read-only copy of the memory a program starts with. It is shared by every
+// instance of that program, and freed when the last one lets go of it.
+typedef struct image {
+	size_t refs;
+	u_int16_t cells[MEM_SIZE];
+} Image;
+
+// arena
+// Hands out memory for instances and their dirty chunks from large blocks.
+// Freed memory is kept on a free list for its size, and is only given back to
+// the system when the whole arena is destroyed.
+typedef struct arena {
+	char *block;
+	size_t used;
+	void *free[ARENA_BLOCK / ARENA_ALIGN + 1];
+} Arena;
+
+// instance
+// The compact state of a parked machine. Only the chunks of memory that differ
+// from the image are stored. They live in a single allocation, which holds the
+// index of each dirty chunk followed by the cells of each dirty chunk.
+typedef struct instance {
+	Image *image;
+	void *dirty;
+	u_int16_t counter, reg, ptr;
+	u_int16_t dirtycount;
+	u_int8_t flags;
+} Instance;
+
+Image *imageShare   (const u_int16_t*);
+void   imageRetain  (Image*);
+void   imageRelease (Image*);
+
+Arena *arenaNew     (void);
+void  *arenaAlloc   (Arena*, size_t);
+void   arenaFree    (Arena*, void*, size_t);
+void   arenaDestroy (Arena*);
+
+Instance *instanceNew  (Arena*, Image*);
+int    instanceSave    (Arena*, Instance*, const u_int16_t*);
+void   instanceLoad    (const Instance*, u_int16_t*);
+size_t instanceSize    (const Instance*);
+void   instanceDelete  (Arena*, Instance*);
+
+#endif
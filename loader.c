@@ -0,0 +1,307 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "loader.h"
+
+static const char *loadBinary  (const u_int8_t*, size_t, u_int16_t*);
+static const char *loadDecimal (const u_int8_t*, size_t, u_int16_t*);
+static const char *loadSparse  (const u_int8_t*, size_t, u_int16_t*);
+static const char *loadMetadata (const u_int8_t*, size_t, Metadata*);
+static const char *readList (const u_int8_t**, const u_int8_t*, u_int8_t*);
+static size_t findMetadata (const u_int8_t*, size_t);
+static int  isDecimal (const u_int8_t*, size_t);
+static void swapCells (u_int16_t*, const u_int8_t*, size_t);
+
+// loadImage
+// Loads an image from a file descriptor into memory. Regular files are mapped,
+// and anything else (like stdin) is read in large blocks. If the image has a
+// metadata section, it is loaded into metadata. On success, it returns NULL.
+// Otherwise, it returns a message saying what was wrong with the image.
+const char *loadImage (int fd, u_int16_t *memory, Metadata *metadata) {
+	struct stat info;
+	const char *err;
+
+	if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode)) {
+		size_t size = (size_t)(info.st_size);
+		if (size == 0) {
+			return loadImageBuffer(NULL, 0, memory, metadata);
+		}
+
+		void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map != MAP_FAILED) {
+			err = loadImageBuffer(map, size, memory, metadata);
+			munmap(map, size);
+			return err;
+		}
+	}
+
+	// no file size to go by, so read until the end
+	size_t size = 0, capacity = 16384;
+	u_int8_t *buffer = malloc(capacity);
+	if (buffer == NULL) { return "out of memory"; }
+
+	ssize_t got;
+	while ((got = read(fd, buffer + size, capacity - size)) > 0) {
+		size += (size_t)(got);
+		if (size == capacity) {
+			capacity *= 2;
+			u_int8_t *bigger = realloc(buffer, capacity);
+			if (bigger == NULL) {
+				free(buffer);
+				return "out of memory";
+			}
+			buffer = bigger;
+		}
+	}
+
+	err = got < 0 ? "could not read image" :
+		loadImageBuffer(buffer, size, memory, metadata);
+	free(buffer);
+	return err;
+}
+
+// loadImageBuffer
+// Works out which format an image is in, and loads it into memory. Cells that
+// the image does not cover are left as they are. On success, it returns NULL.
+// Otherwise, it returns a message saying what was wrong with the image.
+const char *loadImageBuffer (
+	const u_int8_t *data, size_t size, u_int16_t *memory,
+	Metadata *metadata
+) {
+	size_t magic = strlen(SPARSE_MAGIC);
+	size_t cells = findMetadata(data, size);
+
+	if (cells < size) {
+		const char *err = loadMetadata(data + cells, size - cells, metadata);
+		if (err != NULL) { return err; }
+		size = cells;
+	}
+
+	if (size >= magic && memcmp(data, SPARSE_MAGIC, magic) == 0) {
+		return loadSparse(data + magic, size - magic, memory);
+	} else if (isDecimal(data, size)) {
+		return loadDecimal(data, size, memory);
+	} else {
+		return loadBinary(data, size, memory);
+	}
+}
+
+// loadBinary
+// Loads an image made of big-endian 16 bit cells.
+static const char *loadBinary (
+	const u_int8_t *data, size_t size, u_int16_t *memory
+) {
+	if (size % 2 != 0) { return "odd number of bytes in binary image"; }
+	if (size / 2 > MEM_SIZE) { return "binary image is too big"; }
+	swapCells(memory, data, size / 2);
+	return NULL;
+}
+
+// loadDecimal
+// Loads an image made of newline separated decimal numbers, as written by
+// bkasm -d.
+static const char *loadDecimal (
+	const u_int8_t *data, size_t size, u_int16_t *memory
+) {
+	size_t count = 0;
+	const u_int8_t *end = data + size;
+
+	while (data < end) {
+		// skip blank lines
+		if (*data == '\n' || *data == '\r') {
+			data++;
+			continue;
+		}
+
+		unsigned long value = 0;
+		while (data < end && *data >= '0' && *data <= '9') {
+			value = value * 10 + (unsigned long)(*(data++) - '0');
+			if (value > 0xFFFF) { return "decimal cell is too big"; }
+		}
+
+		if (count >= MEM_SIZE) { return "decimal image is too big"; }
+		memory[count++] = (u_int16_t)(value);
+	}
+
+	return NULL;
+}
+
+// loadSparse
+// Loads the records of a sparse image. The magic number has already been
+// skipped.
+static const char *loadSparse (
+	const u_int8_t *data, size_t size, u_int16_t *memory
+) {
+	while (size > 0) {
+		if (size < 4) { return "truncated sparse record"; }
+		size_t addr   = (size_t)(data[0]) << 8 | data[1];
+		size_t header = (size_t)(data[2]) << 8 | data[3];
+		size_t count  = header & ~(size_t)(SPARSE_RUN);
+		data += 4;
+		size -= 4;
+
+		if (addr + count > MEM_SIZE) {
+			return "sparse record goes past the end of memory";
+		}
+
+		if (header & SPARSE_RUN) {
+			if (size < 2) { return "truncated sparse run"; }
+			u_int16_t cell = (u_int16_t)(data[0] << 8 | data[1]);
+			for (size_t i = 0; i < count; i++) {
+				memory[addr + i] = cell;
+			}
+			data += 2;
+			size -= 2;
+		} else {
+			if (size < count * 2) { return "truncated sparse literal"; }
+			swapCells(memory + addr, data, count);
+			data += count * 2;
+			size -= count * 2;
+		}
+	}
+
+	return NULL;
+}
+
+// findMetadata
+// Returns where the metadata section of an image starts, or the size of the
+// image if it doesn't have one.
+static size_t findMetadata (const u_int8_t *data, size_t size) {
+	size_t magic = strlen(METADATA_MAGIC);
+	if (size < magic * 2 + 4) { return size; }
+
+	const u_int8_t *footer = data + size - magic - 4;
+	if (memcmp(footer + 4, METADATA_MAGIC, magic) != 0) { return size; }
+
+	size_t length =
+		(size_t)(footer[0]) << 24 | (size_t)(footer[1]) << 16 |
+		(size_t)(footer[2]) << 8  | (size_t)(footer[3]);
+	if (length > size - magic - 4) { return size; }
+
+	size_t start = size - magic - 4 - length;
+	if (memcmp(data + start, METADATA_MAGIC, magic) != 0) { return size; }
+	return start;
+}
+
+// loadMetadata
+// Loads a metadata section, which has already been found to start and end
+// with the magic number.
+static const char *loadMetadata (
+	const u_int8_t *data, size_t size, Metadata *metadata
+) {
+	const u_int8_t *end = data + size - strlen(METADATA_MAGIC) - 4;
+	const char *err;
+	data += strlen(METADATA_MAGIC);
+
+	if (end - data < 6) { return "truncated metadata"; }
+	if ((data[0] << 8 | data[1]) != METADATA_VERSION) {
+		return "unknown metadata version";
+	}
+	if (metadata == NULL) { return NULL; }
+
+	memset(metadata, 0, sizeof(Metadata));
+	metadata->codecount = (u_int16_t)(data[2] << 8 | data[3]);
+	metadata->datacount = (u_int16_t)(data[4] << 8 | data[5]);
+	data += 6;
+	if (metadata->codecount + metadata->datacount > MEM_SIZE) {
+		return "metadata describes more cells than there are";
+	}
+
+	if ((err = readList(&data, end, metadata->leader))  != NULL ||
+	    (err = readList(&data, end, metadata->target))  != NULL ||
+	    (err = readList(&data, end, metadata->pointer)) != NULL) {
+		return err;
+	}
+
+	if (end - data < 2) { return "truncated metadata"; }
+	metadata->symbolcount = (size_t)(data[0] << 8 | data[1]);
+	data += 2;
+	metadata->symbols = calloc(metadata->symbolcount + 1, sizeof(MetaSymbol));
+	if (metadata->symbols == NULL) { return "out of memory"; }
+
+	for (size_t i = 0; i < metadata->symbolcount; i++) {
+		MetaSymbol *symbol = &metadata->symbols[i];
+		if (end - data < 4) { return "truncated metadata symbol"; }
+		symbol->addr = (u_int16_t)((data[0] << 8 | data[1]) & 0xFFF);
+		symbol->kind = data[2];
+		size_t length = data[3];
+		data += 4;
+
+		if (length >= sizeof(symbol->name) || (size_t)(end - data) < length) {
+			return "bad metadata symbol name";
+		}
+		memcpy(symbol->name, data, length);
+		data += length;
+	}
+
+	if (data != end) { return "trailing bytes in metadata"; }
+	metadata->present = 1;
+	return NULL;
+}
+
+// readList
+// Reads a counted list of addresses from a metadata section, and sets the
+// byte of each one in cells.
+static const char *readList (
+	const u_int8_t **data, const u_int8_t *end, u_int8_t *cells
+) {
+	const u_int8_t *at = *data;
+	if (end - at < 2) { return "truncated metadata list"; }
+	size_t count = (size_t)(at[0] << 8 | at[1]);
+	at += 2;
+
+	if ((size_t)(end - at) < count * 2) { return "truncated metadata list"; }
+	for (size_t i = 0; i < count; i++, at += 2) {
+		size_t addr = (size_t)(at[0] << 8 | at[1]);
+		if (addr >= MEM_SIZE) { return "metadata address out of range"; }
+		cells[addr] = 1;
+	}
+
+	*data = at;
+	return NULL;
+}
+
+// isDecimal
+// Returns 1 if an image only holds decimal digits and line breaks, and has at
+// least one line break.
+static int isDecimal (const u_int8_t *data, size_t size) {
+	int lines = 0;
+	for (size_t i = 0; i < size; i++) {
+		if (data[i] == '\n') {
+			lines = 1;
+		} else if (data[i] != '\r' && (data[i] < '0' || data[i] > '9')) {
+			return 0;
+		}
+	}
+	return lines;
+}
+
+// swapCells
+// Turns big-endian bytes into cells. Four cells are swapped at a time by
+// loading them as one 64 bit word and swapping the two bytes in each 16 bit
+// lane with masks and shifts, so that this stays fast without relying on the
+// compiler to vectorise it. Whatever is left over is done one cell at a time.
+static void swapCells (
+	u_int16_t *restrict dest, const u_int8_t *restrict src, size_t count
+) {
+	size_t i = 0;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	for (; i + 4 <= count; i += 4) {
+		u_int64_t word;
+		memcpy(&word, src + 2 * i, sizeof(word));
+		word =
+			(word & 0x00FF00FF00FF00FFull) << 8 |
+			(word >> 8 & 0x00FF00FF00FF00FFull);
+		memcpy(dest + i, &word, sizeof(word));
+	}
+#elif __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	memcpy(dest, src, count * 2);
+	i = count;
+#endif
+	for (; i < count; i++) {
+		dest[i] = (u_int16_t)(src[2 * i] << 8 | src[2 * i + 1]);
+	}
+}
@@ -0,0 +1,53 @@
+#ifndef LOADER_H
+#define LOADER_H
+
+#include <sys/types.h>
+
+// amount of 16 bit memory cells
+#ifndef MEM_SIZE
+#define MEM_SIZE 4096
+#endif
+
+// sparse images start with this, and are made up of records after it. each
+// record has a big-endian address and header. if the top bit of the header is
+// set, the rest of it is a count, and it is followed by one cell that is
+// repeated that many times. otherwise, the header is a count of the literal
+// cells that follow it.
+#define SPARSE_MAGIC "BKRL"
+#define SPARSE_RUN   0x8000
+
+// any image can be followed by a metadata section written by bkasm -e, which
+// starts and ends with this. see writeMetadata in bkasm.c for the layout.
+#define METADATA_MAGIC   "BKMD"
+#define METADATA_VERSION 1
+
+// symbol kinds
+#define SYMBOL_LABEL    0
+#define SYMBOL_VARIABLE 1
+
+// metadata
+// What bkasm knew about a program when it assembled it. Cells below the code
+// count are instructions, and the data cells come right after them. Leaders,
+// targets and pointers have one byte per cell, which is set for cells that
+// start a basic block, that are jumped to, or that are variables initialized
+// as pointers.
+typedef struct metaSymbol {
+	u_int16_t addr;
+	u_int8_t kind;
+	char name[16];
+} MetaSymbol;
+
+typedef struct metadata {
+	int present;
+	u_int16_t codecount, datacount;
+	u_int8_t leader[MEM_SIZE];
+	u_int8_t target[MEM_SIZE];
+	u_int8_t pointer[MEM_SIZE];
+	size_t symbolcount;
+	MetaSymbol *symbols;
+} Metadata;
+
+const char *loadImage (int, u_int16_t*, Metadata*);
+const char *loadImageBuffer (const u_int8_t*, size_t, u_int16_t*, Metadata*);
+
+#endif
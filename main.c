@@ -1,13 +1,29 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
 #include <unistd.h>
 #include <termios.h>
-
-#include "mccharmap.h"
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 // amount of 16 bit memory cells
 #define MEM_SIZE 4096
 
+#include "mccharmap.h"
+#include "instance.h"
+#include "loader.h"
+
+// limits for branch exploration mode
+#define BRANCH_MAX_DEPTH   64
+#define BRANCH_OUTPUT_SIZE 65536
+
 // options
 // This struct stores information about how the user wants to run the program.
 // The information is collected by parseCommandLineArgs.
@@ -17,7 +33,15 @@ static struct {
 	int stdin;
 	int debug;
 	int help;
+	int depth;
+	int interval;
 	int PADDING; // delete this if another 4 bytes are added
+	u_int64_t limit;
+	char *keys;
+	char *timing;
+	char *socket;
+	char *symbols;
+	char *stats;
 	char *path;
 } options = { 0 };
 
@@ -31,16 +55,147 @@ static struct {
 	u_int16_t reg, ptr, opcode, address;
 } machine = { 0 };
 
+// branch
+// This struct stores the state of branch exploration mode. Every process in the
+// exploration tree has its own copy of it, inherited from its parent on fork.
+// The job pipe holds one byte per free job slot, and the lock pipe holds a
+// single byte that is used to keep reports from being interleaved.
+static struct {
+	int depth;
+	int truncated;
+	int jobs[2];
+	int lock[2];
+	size_t outputLength;
+	char path[BRANCH_MAX_DEPTH + 1];
+	char output[BRANCH_OUTPUT_SIZE];
+} branch = { 0 };
+
+// debugger
+// This struct stores the state of the debugger. The execution loops check the
+// trap byte of each cell before running it, and only call into the debugger if
+// it is set. The trap bytes mirror the breakpoints while the program is
+// running freely, and are all set while it is being stepped. The watch bitmap
+// has one bit per cell, and is checked whenever a cell is written to.
+static struct {
+	int steps;
+	int watchHit;
+	int halted;
+	int PADDING; // delete this if another 4 bytes are added
+	FILE *in, *out;
+	Arena *arena;
+	Image *image;
+	size_t savecount, savesize;
+	Instance **saves;
+	u_int8_t trap[MEM_SIZE];
+	u_int8_t breakpoint[MEM_SIZE];
+	u_int8_t watch[MEM_SIZE / 8];
+} debugger = { 0 };
+
+// symbols
+// This struct stores the symbol table loaded from a file written by bkasm.
+typedef struct symbol {
+	u_int16_t addr;
+	u_int8_t kind;
+	char name[16];
+} Symbol;
+
+static struct {
+	size_t count, size;
+	Symbol *list;
+} symbols = { 0 };
+
+// metadata
+// What bkasm knew about the program, if the image has a metadata section.
+static Metadata metadata = { 0 };
+
+// stats
+// This struct stores runtime statistics. They are cheap enough to always be
+// collected. A cell is marked as executed the first time it is run, or up front
+// if the image metadata says it is code, so that writes to it can be counted
+// as self modifying. The dump flag is set from signal handlers, and is serviced
+// through the trap bytes.
+static struct {
+	volatile sig_atomic_t dump;
+	int waiting;
+	pid_t pid;
+	u_int64_t retired;
+	u_int64_t opcodes[16];
+	u_int64_t charsIn, charsOut;
+	u_int64_t selfModifying;
+	double inputWait;
+	struct timespec start, inputStart;
+	u_int8_t executed[MEM_SIZE];
+} stats = { 0 };
+
+// timing
+// This struct stores the redstone timing model for the minecraft instruction
+// set. Every instruction costs a base amount of ticks for its opcode, plus
+// some for each memory access it makes, for going through the pointer, and
+// for taking a jump. Ticks and runs are tallied per cell, and cells that start
+// a basic block are marked as leaders, so that the report can add them up by
+// block and by label afterwards.
+static struct {
+	u_int32_t opcode[16];
+	u_int32_t memory, pointer, jump;
+	u_int32_t step[16];
+	u_int64_t ticks[MEM_SIZE];
+	u_int64_t runs[MEM_SIZE];
+	u_int8_t leader[MEM_SIZE];
+} timing = {
+	//         *=  <-  ->  xx  ++  --  +=  -=  >>  <<  ??  go  if> if< if= if!
+	.opcode = { 4,  4,  4,  4,  6,  6,  8,  8,  4,  4,  6,  2,  3,  3,  3,  3 },
+	.memory  = 6,
+	.pointer = 2,
+	.jump    = 2
+};
+
+// memory accesses made by each minecraft opcode
+static const u_int8_t mcAccesses[16] = {
+	1, 1, 1, 1, 2, 2, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0
+};
+
 // function prototypes
 u_int16_t readInput (void);
+u_int16_t branchAtInput (void);
 int  parseCommandLineArgs (int, char**);
-void loadFile             (FILE*);
+int  takeSwitchValue      (char**, int*, int, char**);
 void runWithLegacySet     (void);
 void runWithMinecraftSet  (void);
+void writeOutput          (int);
+void writeString          (const char*);
+void branchStart          (void);
+void branchEnd            (void);
+void branchTakeToken      (int*);
+void branchGiveToken      (int*);
+void writeMemory          (u_int16_t, u_int16_t);
+int  loadSymbols          (const char*);
+void addSymbol            (u_int16_t, const char*, u_int8_t);
+void useMetadata          (void);
+int  findSymbol           (const char*);
+int  debugAttach          (const char*);
+void serviceTrap          (void);
+void armTraps             (void);
+void debugTrap            (void);
+int  debugEnd             (void);
+void debugCommands        (void);
+void debugSave            (void);
+void debugRestore         (const char*);
+int  debugLocation        (const char*);
 void debugCPUState        (void);
+void exceededLimit        (void);
+int  timingStart          (const char*);
+void timingStep           (u_int16_t, u_int16_t);
+void timingReport         (void);
+int  compareSymbols       (const void*, const void*);
+void statsStart           (void);
+void statsSignal          (int);
+void statsExit            (void);
+void statsWrite           (void);
+double secondsSince       (struct timespec*);
 
 int main (int argc, char **argv) {
-	FILE *image = NULL;
+	int image = -1;
+	const char *err;
 	
 	// parse command line options
 	if (parseCommandLineArgs(argc, argv)) { return EXIT_FAILURE; }
@@ -52,6 +207,15 @@ int main (int argc, char **argv) {
 		puts("  -c    Enable minecraft charset");
 		puts("  -x    Read image file from stdin");
 		puts("  -d    Enable debug logging");
+		puts("  -b    Explore every key in the next arg at each input");
+		puts("  -l    Maximum number of inputs to explore (default 1)");
+		puts("  -g    Wait for a debugger on the socket in the next arg");
+		puts("  -s    Load bkasm symbols from the file in the next arg");
+		puts("  -j    Write statistics as JSON to the file in the next arg");
+		puts("  -i    Also write statistics every N seconds");
+		puts("  -n    Stop with an error after N instructions");
+		puts("  -t    Estimate redstone ticks with the cost table in the");
+		puts("        next arg (- for the built in one)");
 		puts("  -h    Show help");
 		return EXIT_SUCCESS;
 	}
@@ -63,12 +227,12 @@ int main (int argc, char **argv) {
 
 	// open file (or read directly from stdin)
 	if (options.stdin) {
-		image = stdin;
+		image = 0;
 	} else {
-		image = fopen(options.path, "r");
+		image = open(options.path, O_RDONLY);
 	}
 
-	if (image == NULL) {
+	if (image < 0) {
 		fprintf (
 			stderr,
 			"%s: ERR could not open file %s\n", argv[0],
@@ -76,16 +240,59 @@ int main (int argc, char **argv) {
 		return EXIT_FAILURE;
 	}
 
-	// read file into buffer
-	loadFile(image);
+	// read file into memory
+	if ((err = loadImage(image, machine.memory, &metadata)) != NULL) {
+		fprintf (
+			stderr,
+			"%s: ERR could not load image %s: %s\n", argv[0],
+			options.stdin ? "from stdin" : options.path, err);
+		return EXIT_FAILURE;
+	}
+	if (!options.stdin) { close(image); }
+	if (metadata.present) { useMetadata(); }
 
-	// run CPU
-	if (options.minecraft) {
-		runWithMinecraftSet();
-	} else {
-		runWithLegacySet();
+	if (options.symbols != NULL && loadSymbols(options.symbols)) {
+		fprintf (
+			stderr,
+			"%s: ERR could not load symbols from %s\n", argv[0],
+			options.symbols);
+		return EXIT_FAILURE;
+	}
+
+	if (options.socket != NULL && debugAttach(options.socket)) {
+		fprintf (
+			stderr,
+			"%s: ERR could not attach debugger on %s\n", argv[0],
+			options.socket);
+		return EXIT_FAILURE;
 	}
 
+	if (options.timing != NULL && timingStart(options.timing)) {
+		fprintf (
+			stderr,
+			"%s: ERR could not load cost table from %s\n", argv[0],
+			options.timing);
+		return EXIT_FAILURE;
+	}
+
+	if (options.keys != NULL) { branchStart(); }
+	statsStart();
+
+	// run CPU. if a debugger restores a snapshot after the program halts,
+	// it gets run again from there.
+	do {
+		if (options.minecraft) {
+			runWithMinecraftSet();
+		} else {
+			runWithLegacySet();
+		}
+	} while (options.socket != NULL && debugEnd());
+
+	if (options.timing != NULL) { timingReport(); }
+
+	// a branch that halts before reaching the depth limit ends here
+	if (options.keys != NULL) { branchEnd(); }
+
 	return EXIT_SUCCESS;
 }
 
@@ -93,6 +300,8 @@ int main (int argc, char **argv) {
 // This function parses all command line arguments into the options struct. On
 // success, it returns 0. If an error was encountered, it returns 1.
 int parseCommandLineArgs (int argc, char **argv) {
+	char *depth = NULL, *interval = NULL, *limit = NULL;
+
 	for (int i = 1, getSwitches = 1; i < argc; i++) {
 		char *ch = argv[i];
 		if (*ch == '-' && getSwitches) {
@@ -104,6 +313,38 @@ int parseCommandLineArgs (int argc, char **argv) {
 				case 'x': options.stdin     = 1; break;
 				case 'd': options.debug     = 1; break;
 				case 'h': options.help      = 1; break;
+				case 'b':
+					if (takeSwitchValue(&options.keys, &i, argc, argv))
+						return 1;
+					break;
+				case 'l':
+					if (takeSwitchValue(&depth, &i, argc, argv))
+						return 1;
+					break;
+				case 'g':
+					if (takeSwitchValue(&options.socket, &i, argc, argv))
+						return 1;
+					break;
+				case 's':
+					if (takeSwitchValue(&options.symbols, &i, argc, argv))
+						return 1;
+					break;
+				case 'j':
+					if (takeSwitchValue(&options.stats, &i, argc, argv))
+						return 1;
+					break;
+				case 'i':
+					if (takeSwitchValue(&interval, &i, argc, argv))
+						return 1;
+					break;
+				case 'n':
+					if (takeSwitchValue(&limit, &i, argc, argv))
+						return 1;
+					break;
+				case 't':
+					if (takeSwitchValue(&options.timing, &i, argc, argv))
+						return 1;
+					break;
 			}
 		}
 		else if (options.path == NULL) {
@@ -118,6 +359,77 @@ int parseCommandLineArgs (int argc, char **argv) {
 		}
 	}
 
+	options.depth = depth == NULL ? 1 : atoi(depth);
+	if (options.depth < 1 || options.depth > BRANCH_MAX_DEPTH) {
+		fprintf (
+			stderr,
+			"%s: ERR exploration depth must be between 1 and %i\n",
+			argv[0], BRANCH_MAX_DEPTH);
+		return 1;
+	}
+
+	options.limit = ~(u_int64_t)(0);
+	if (limit != NULL) {
+		char *end;
+		errno = 0;
+		options.limit = strtoull(limit, &end, 10);
+		if (
+			*end != 0 || end == limit || limit[0] == '-' ||
+			errno != 0 || options.limit == 0
+		) {
+			fprintf (
+				stderr,
+				"%s: ERR instruction limit must be a positive number\n",
+				argv[0]);
+			return 1;
+		}
+	}
+
+	options.interval = interval == NULL ? 0 : atoi(interval);
+	if (options.interval < 0 || (options.interval > 0 && !options.stats)) {
+		fprintf (
+			stderr,
+			"%s: ERR statistics interval needs a positive -i and a -j file\n",
+			argv[0]);
+		return 1;
+	}
+
+	if (options.keys != NULL && *options.keys == 0) {
+		fprintf(stderr, "%s: ERR no keys given to explore\n", argv[0]);
+		return 1;
+	}
+
+	if (options.timing != NULL && !options.minecraft) {
+		fprintf (
+			stderr,
+			"%s: ERR timing is only modeled for the minecraft set\n",
+			argv[0]);
+		return 1;
+	}
+
+	if (options.keys != NULL && options.socket != NULL) {
+		fprintf (
+			stderr,
+			"%s: ERR cannot explore branches with a debugger attached\n",
+			argv[0]);
+		return 1;
+	}
+
+	return 0;
+}
+
+// takeSwitchValue
+// Stores the arg following the current one in dest, and advances the arg
+// index past it. If there is no such arg, it prints an error and returns 1.
+int takeSwitchValue (char **dest, int *i, int argc, char **argv) {
+	if (*i + 1 >= argc) {
+		fprintf (
+			stderr,
+			"%s: ERR switch %s expects a value\n",
+			argv[0], argv[*i]);
+		return 1;
+	}
+	*dest = argv[++(*i)];
 	return 0;
 }
 
@@ -125,10 +437,17 @@ int parseCommandLineArgs (int argc, char **argv) {
 // Runs the cpu with the legacy instruction set found in the textbook.
 void runWithLegacySet (void) {
 	while (machine.counter < MEM_SIZE) {
+		if (debugger.trap[machine.counter]) { serviceTrap(); }
+
 		machine.opcode  = machine.memory[machine.counter] >> 12;
 		machine.address = machine.memory[machine.counter] & 0xFFF;
 		debugCPUState();
 
+		if (stats.retired == options.limit) { exceededLimit(); }
+		stats.retired++;
+		stats.opcodes[machine.opcode]++;
+		stats.executed[machine.counter] = 1;
+
 		switch (machine.opcode) {
 		case 0x0:
 			// load value at address to register
@@ -136,11 +455,11 @@ void runWithLegacySet (void) {
 			break;
 		case 0x1:
 			// store value of register at address
-			machine.memory[machine.address] = machine.reg; 
+			writeMemory(machine.address, machine.reg);
 			break;
 		case 0x2:
 			// set vaue at address to zero
-			machine.memory[machine.address] = 0;
+			writeMemory(machine.address, 0);
 			break;
 		case 0x3:
 			// add vaue at address to register
@@ -148,7 +467,9 @@ void runWithLegacySet (void) {
 			break;
 		case 0x4:
 			// increment value at address
-			machine.memory[machine.address] ++;
+			writeMemory (
+				machine.address,
+				(u_int16_t)(machine.memory[machine.address] + 1));
 			break;
 		case 0x5:
 			// subtract value at address from register
@@ -156,7 +477,9 @@ void runWithLegacySet (void) {
 			break;
 		case 0x6:
 			// decrement value at address
-			machine.memory[machine.address] --;
+			writeMemory (
+				machine.address,
+				(u_int16_t)(machine.memory[machine.address] - 1));
 			break;
 		case 0x7:
 			// compare value at address against the register, and
@@ -202,11 +525,11 @@ void runWithLegacySet (void) {
 			// read a single character from the input (stdin) and
 			// store it at address. this pauses until a character is
 			// available to read.
-			machine.memory[machine.address] = readInput();
+			writeMemory(machine.address, readInput());
 			break;
 		case 0xe:
 			// send the value at address to the output (stdout)
-			putchar(machine.memory[machine.address]);
+			writeOutput(machine.memory[machine.address]);
 			break;
 		case 0xf:
 			// halt the program
@@ -221,15 +544,25 @@ void runWithLegacySet (void) {
 // Runs the cpu with the new instruction set.
 void runWithMinecraftSet (void) {
 	int ch;
+	u_int16_t pc, instruction;
 
 	while (machine.counter < MEM_SIZE) {
-		machine.opcode  = machine.memory[machine.counter] >> 12;
-		machine.address = machine.memory[machine.counter] & 0xFFF;
+		if (debugger.trap[machine.counter]) { serviceTrap(); }
+
+		pc = (u_int16_t)(machine.counter);
+		instruction = machine.memory[pc];
+		machine.opcode  = instruction >> 12;
+		machine.address = instruction & 0xFFF;
 		debugCPUState();
 
 		if (machine.address == 0xFFF) { machine.address = machine.ptr; }
 		if (machine.counter == 0xFFE) { return; }
-		
+
+		if (stats.retired == options.limit) { exceededLimit(); }
+		stats.retired++;
+		stats.opcodes[machine.opcode]++;
+		stats.executed[machine.counter] = 1;
+
 		switch (machine.opcode) {
 		case 0x0:
 			// load value at address to pointer
@@ -241,19 +574,23 @@ void runWithMinecraftSet (void) {
 			break;
 		case 0x2:
 			// store of register at address
-			machine.memory[machine.address] = machine.reg;
+			writeMemory(machine.address, machine.reg);
 			break;
 		case 0x3:
 			// set value at address to zero
-			machine.memory[machine.address] = 0;
+			writeMemory(machine.address, 0);
 			break;
 		case 0x4:
 			// increment value at address
-			machine.memory[machine.address] ++;
+			writeMemory (
+				machine.address,
+				(u_int16_t)(machine.memory[machine.address] + 1));
 			break;
 		case 0x5:
 			// decrement value at address
-			machine.memory[machine.address] --;
+			writeMemory (
+				machine.address,
+				(u_int16_t)(machine.memory[machine.address] - 1));
 			break;
 		case 0x6:
 			// add value at address to register
@@ -275,7 +612,7 @@ void runWithMinecraftSet (void) {
 			} else if (ch >= 'a' && ch <= 'z') {
 				ch -= 32;
 			}
-			machine.memory[machine.address] = (u_int16_t)(asciiToMc[ch]);
+			writeMemory(machine.address, (u_int16_t)(asciiToMc[ch]));
 			if (options.debug) fprintf (
 				stderr,
 				"debug: got char %c which is %02x -> %02X\n",
@@ -289,17 +626,17 @@ void runWithMinecraftSet (void) {
 			ch = machine.memory[machine.address] & 0x3F;
 			if (ch < 6) {
 				switch (ch) {
-				case 0: putchar(0);   break;
-				case 1: putchar(EOF); break;
-				case 2: fputs("\033[1A", stdout); break;
-				case 3: fputs("\033[1B", stdout); break;
-				case 4: fputs("\033[1D", stdout); break;
-				case 5: fputs("\033[1C", stdout); break;
+				case 0: writeOutput(0);   break;
+				case 1: writeOutput(EOF); break;
+				case 2: writeString("\033[1A"); break;
+				case 3: writeString("\033[1B"); break;
+				case 4: writeString("\033[1D"); break;
+				case 5: writeString("\033[1C"); break;
 				}
 			} else if (ch < 256 ) {
-				putchar(mcToAscii[ch]);
+				writeOutput(mcToAscii[ch]);
 			} else {
-				putchar(0);
+				writeOutput(0);
 			}
 			break;
 		case 0xa:
@@ -344,29 +681,27 @@ void runWithMinecraftSet (void) {
 			break;
 		}
 
+		if (options.timing) { timingStep(pc, instruction); }
 		machine.counter++;
 	}
 }
 
-// loadFile
-// Loads 4096 big-endian 16 bit integers from file into memory cells, starting
-// at address 0.
-void loadFile (FILE *file) {
-	int ch, i = 0;
-	while (i < MEM_SIZE && (ch = fgetc(file)) != EOF) {
-		u_int16_t largeEnd = (u_int16_t)(ch);
-		u_int16_t smallEnd = (u_int16_t)(fgetc(file));
-		
-		machine.memory[i] = largeEnd * 256 + smallEnd;
-		i ++;
-	}
-}
-
 // readInput
 // Reads one character of input from stdin. It disables line buffering so that
 // if the user types a key, it is registered instantly.
 u_int16_t readInput (void) {
-	u_int16_t ch;
+	int ch;
+	unsigned char byte;
+	fd_set ready;
+	sigset_t dumps, mask;
+
+	if (options.keys != NULL) {
+		ch = branchAtInput();
+		stats.charsIn++;
+		return (u_int16_t)(ch);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &stats.inputStart);
+	stats.waiting = 1;
 	
 	struct termios old;
 	tcgetattr(0, &old);
@@ -375,12 +710,490 @@ u_int16_t readInput (void) {
 	old.c_cc[VMIN] = 1;
 	old.c_cc[VTIME] = 0;
 	tcsetattr(0, TCSANOW, &old);
-	ch = (u_int16_t)(getchar());
+
+	// statistics can be asked for while we are waiting here. the signals
+	// are only let through while waiting, so that one can't slip in between
+	// checking for a dump and starting to wait. only the dump is serviced,
+	// since we are in the middle of an instruction.
+	sigemptyset(&dumps);
+	sigaddset(&dumps, SIGUSR1);
+	sigaddset(&dumps, SIGALRM);
+	sigprocmask(SIG_BLOCK, &dumps, &mask);
+	for (;;) {
+		if (stats.dump) {
+			stats.dump = 0;
+			statsWrite();
+		}
+		FD_ZERO(&ready);
+		FD_SET(0, &ready);
+		if (pselect(1, &ready, NULL, NULL, NULL, &mask) >= 0) { break; }
+		if (errno != EINTR) { break; }
+	}
+	sigprocmask(SIG_SETMASK, &mask, NULL);
+	ch = read(0, &byte, 1) == 1 ? byte : EOF;
+	if (ch != EOF) { stats.charsIn++; }
+
 	old.c_lflag |= ICANON;
 	old.c_lflag |= ECHO;
 	tcsetattr(0, TCSADRAIN, &old);
-	
-	return ch;
+
+	stats.waiting = 0;
+	stats.inputWait += secondsSince(&stats.inputStart);
+	return (u_int16_t)(ch);
+}
+
+// writeOutput
+// Sends one character to the output. In branch exploration mode, the output is
+// collected so that it can be reported along with the inputs that produced it.
+void writeOutput (int ch) {
+	stats.charsOut++;
+	if (options.keys == NULL) {
+		putchar(ch);
+	} else if (branch.outputLength < BRANCH_OUTPUT_SIZE) {
+		branch.output[branch.outputLength++] = (char)(ch);
+	} else {
+		branch.truncated = 1;
+	}
+}
+
+// writeString
+// Sends a string to the output, one character at a time.
+void writeString (const char *str) {
+	while (*str != 0) { writeOutput(*(str++)); }
+}
+
+// branchStart
+// Sets up the job and lock pipes for branch exploration mode. There is one job
+// slot per online processor, and the calling process holds one of them.
+void branchStart (void) {
+	long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	if (jobs < 1) { jobs = 1; }
+
+	if (pipe(branch.jobs) || pipe(branch.lock)) {
+		perror("ERR could not create branch pipes");
+		exit(EXIT_FAILURE);
+	}
+
+	for (long i = 1; i < jobs; i++) { branchGiveToken(branch.jobs); }
+	branchGiveToken(branch.lock);
+}
+
+// branchAtInput
+// Checkpoints the machine at an input instruction, and clones it once for each
+// key that is being explored. The clones are forked, so they share all of the
+// memory they don't modify with this process copy-on-write. Each clone returns
+// its key as if it had been typed in. Clones are only started when there is a
+// free job slot, so no more than one clone per processor runs at a time. This
+// process gives its own slot up while it waits, and then exits once all of its
+// clones are done, so this function never returns to it. When the depth limit
+// has been reached, the current branch is reported and ended instead.
+u_int16_t branchAtInput (void) {
+	if (branch.depth >= options.depth) { branchEnd(); }
+
+	// clones must not inherit anything that is still waiting to be written
+	fflush(stdout);
+	fflush(stderr);
+
+	branchGiveToken(branch.jobs);
+	for (char *key = options.keys; *key != 0; key++) {
+		branchTakeToken(branch.jobs);
+
+		pid_t pid = fork();
+		if (pid == 0) {
+			branch.path[branch.depth++] = *key;
+			return (u_int16_t)(*key);
+		} else if (pid < 0) {
+			perror("ERR could not fork branch");
+			branchGiveToken(branch.jobs);
+		}
+	}
+
+	while (wait(NULL) > 0 || errno == EINTR);
+	exit(EXIT_SUCCESS);
+}
+
+// branchEnd
+// Reports the keys that were fed into the current branch and the output that
+// they produced, and then ends the branch, giving its job slot back.
+void branchEnd (void) {
+	branchTakeToken(branch.lock);
+	printf (
+		"branch [%s] %zu bytes%s\n",
+		branch.path, branch.outputLength,
+		branch.truncated ? " (truncated)" : "");
+	fwrite(branch.output, 1, branch.outputLength, stdout);
+	putchar('\n');
+	fflush(stdout);
+	branchGiveToken(branch.lock);
+
+	branchGiveToken(branch.jobs);
+	exit(EXIT_SUCCESS);
+}
+
+// branchTakeToken
+// Takes one byte out of a token pipe, waiting until one is available.
+void branchTakeToken (int *tokens) {
+	char token;
+	while (read(tokens[0], &token, 1) != 1);
+}
+
+// branchGiveToken
+// Puts one byte back into a token pipe.
+void branchGiveToken (int *tokens) {
+	char token = 0;
+	while (write(tokens[1], &token, 1) != 1);
+}
+
+// writeMemory
+// Stores a value in a memory cell. If the cell is being watched by the
+// debugger, the program is stopped before the next instruction runs.
+void writeMemory (u_int16_t address, u_int16_t value) {
+	machine.memory[address] = value;
+	if (stats.executed[address]) { stats.selfModifying++; }
+	if (debugger.watch[address >> 3] & (1 << (address & 7))) {
+		debugger.watchHit = address + 1;
+		memset(debugger.trap, 1, MEM_SIZE);
+	}
+}
+
+// loadSymbols
+// Loads a symbol table written by bkasm -s. Each line holds a hex address, a
+// name, and a kind, which is 0 for labels and 1 for variables. Tables without
+// kinds are treated as all labels. On success, it returns 0. If the file could
+// not be read, it returns 1.
+int loadSymbols (const char *path) {
+	FILE *file = fopen(path, "r");
+	if (file == NULL) { return 1; }
+
+	unsigned int addr, kind;
+	char line[64], name[16];
+	while (fgets(line, sizeof(line), file) != NULL) {
+		kind = SYMBOL_LABEL;
+		if (sscanf(line, "%x %15s %u", &addr, name, &kind) < 2) { continue; }
+		addSymbol((u_int16_t)(addr & 0xFFF), name, (u_int8_t)(kind));
+	}
+
+	fclose(file);
+	return 0;
+}
+
+// addSymbol
+// Adds a symbol to the symbol table.
+void addSymbol (u_int16_t addr, const char *name, u_int8_t kind) {
+	if (symbols.count >= symbols.size) {
+		symbols.size = symbols.size == 0 ? 16 : symbols.size * 2;
+		symbols.list = realloc(symbols.list, symbols.size * sizeof(Symbol));
+	}
+	Symbol *symbol = &symbols.list[symbols.count++];
+	symbol->addr = addr;
+	symbol->kind = kind;
+	strncpy(symbol->name, name, sizeof(symbol->name) - 1);
+	symbol->name[sizeof(symbol->name) - 1] = 0;
+}
+
+// useMetadata
+// Sets things up from the metadata section of the image, so that they don't
+// have to be worked out while the program runs. Its symbols go into the symbol
+// table, its code cells are counted as code for statistics, and its basic
+// blocks seed the timing model.
+void useMetadata (void) {
+	for (size_t i = 0; i < metadata.symbolcount; i++) {
+		addSymbol (
+			metadata.symbols[i].addr, metadata.symbols[i].name,
+			metadata.symbols[i].kind);
+	}
+	memset(stats.executed, 1, metadata.codecount);
+	memcpy(timing.leader, metadata.leader, MEM_SIZE);
+
+	if (options.debug) fprintf (
+		stderr,
+		"debug: metadata has %u code cells, %u data cells, %zu symbols\n",
+		metadata.codecount, metadata.datacount, metadata.symbolcount);
+}
+
+// findSymbol
+// Returns the address of the symbol with the given name, or -1 if there is no
+// such symbol.
+int findSymbol (const char *name) {
+	for (size_t i = 0; i < symbols.count; i++) {
+		if (strcmp(symbols.list[i].name, name) == 0) {
+			return symbols.list[i].addr;
+		}
+	}
+	return -1;
+}
+
+// debugAttach
+// Listens on a unix socket at path, and waits for a debugger to connect to it.
+// The program is stopped before its first instruction. On success, it returns
+// 0. If anything went wrong, it returns 1.
+int debugAttach (const char *path) {
+	struct sockaddr_un addr = { 0 };
+	if (strlen(path) >= sizeof(addr.sun_path)) { return 1; }
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	// a socket left over from an earlier run can be replaced, but anything
+	// else at the path is left alone
+	struct stat info;
+	if (lstat(path, &info) == 0) {
+		if (!S_ISSOCK(info.st_mode)) { return 1; }
+		unlink(path);
+	}
+
+	int server = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (server < 0) { return 1; }
+	if (
+		bind(server, (struct sockaddr *)(&addr), sizeof(addr)) ||
+		listen(server, 1)
+	) {
+		close(server);
+		return 1;
+	}
+
+	fprintf(stderr, "waiting for debugger on %s\n", path);
+	int conn = accept(server, NULL, NULL);
+	close(server);
+	unlink(path);
+	if (conn < 0) { return 1; }
+
+	// if the debugger goes away, writing to it should fail rather than kill
+	// the program
+	signal(SIGPIPE, SIG_IGN);
+
+	debugger.in  = fdopen(conn, "r");
+	debugger.out = fdopen(dup(conn), "w");
+	if (debugger.in == NULL || debugger.out == NULL) { return 1; }
+	setvbuf(debugger.out, NULL, _IOLBF, 0);
+
+	// snapshots only store what differs from the memory the program started
+	// with, so keep a copy of it to compare against
+	debugger.arena = arenaNew();
+	debugger.image = imageShare(machine.memory);
+	if (debugger.arena == NULL || debugger.image == NULL) { return 1; }
+
+	// stop before the first instruction, as if a step was just taken
+	debugger.steps = 1;
+	memset(debugger.trap, 1, MEM_SIZE);
+	return 0;
+}
+
+// serviceTrap
+// Called by the execution loops when the trap byte of the current cell is set.
+// It handles whatever asked for the program's attention, and then re-arms the
+// trap bytes.
+void serviceTrap (void) {
+	if (stats.dump) {
+		stats.dump = 0;
+		statsWrite();
+	}
+
+	if (debugger.out != NULL) { debugTrap(); }
+	armTraps();
+
+	// a signal may have come in while the trap bytes were being re-armed
+	if (stats.dump) { memset(debugger.trap, 1, MEM_SIZE); }
+}
+
+// armTraps
+// Sets the trap bytes up for however the program is going to carry on. They
+// are all set while stepping, and mirror the breakpoints otherwise.
+void armTraps (void) {
+	if (debugger.steps > 0) {
+		memset(debugger.trap, 1, MEM_SIZE);
+	} else {
+		memcpy(debugger.trap, debugger.breakpoint, MEM_SIZE);
+	}
+}
+
+// debugTrap
+// Works out whether the program should stop at the current cell, and if so,
+// reports why and takes commands until it is told to carry on. Traps that
+// were set for something else, like a statistics dump, are ignored.
+void debugTrap (void) {
+	int breakpoint = debugger.breakpoint[machine.counter];
+
+	if (!breakpoint && !debugger.steps && !debugger.watchHit) {
+		return;
+	} else if (debugger.watchHit) {
+		fprintf (
+			debugger.out, "stopped watch %03X at %03X\n",
+			debugger.watchHit - 1, machine.counter);
+		debugger.watchHit = 0;
+	} else if (debugger.steps > 0 && --debugger.steps > 0 && !breakpoint) {
+		return;
+	} else {
+		fprintf (
+			debugger.out, "stopped %s at %03X\n",
+			breakpoint ? "break" : "step", machine.counter);
+	}
+
+	debugger.steps = 0;
+	debugCommands();
+}
+
+// debugEnd
+// Tells the debugger that the program has halted, and keeps taking commands so
+// that the final state of the machine can be looked at. If a snapshot gets
+// restored and the program is told to carry on, it returns 1. Otherwise, it
+// returns 0.
+int debugEnd (void) {
+	if (debugger.out == NULL) { return 0; }
+	fprintf(debugger.out, "halted at %03X\n", machine.counter);
+	debugger.halted = 1;
+	debugCommands();
+	if (debugger.halted) { return 0; }
+
+	armTraps();
+	return 1;
+}
+
+// debugCommands
+// Reads commands from the debugger, one per line, until it tells the program
+// to carry on. Every command is answered with a line starting with "ok" or
+// "err". Locations can be given as a symbol name or a hex address.
+void debugCommands (void) {
+	char line[256], command[16], arg0[64], arg1[64];
+
+	for (;;) {
+		if (fgets(line, sizeof(line), debugger.in) == NULL) { break; }
+
+		int argc = sscanf(line, "%15s %63s %63s", command, arg0, arg1) - 1;
+		int loc  = argc > 0 ? debugLocation(arg0) : 0;
+		if (argc < 0) { continue; }
+
+		if (strcmp(command, "restore") == 0 && argc > 0) {
+			debugRestore(arg0);
+		} else if (argc > 0 && loc < 0 && strcmp(command, "step") != 0) {
+			fprintf(debugger.out, "err unknown location %s\n", arg0);
+		} else if (
+			strcmp(command, "step") == 0 ||
+			strcmp(command, "continue") == 0
+		) {
+			if (debugger.halted) {
+				fputs("err halted\n", debugger.out);
+				continue;
+			}
+			debugger.steps = command[0] != 's' ? 0 :
+				argc > 0 ? atoi(arg0) : 1;
+			fputs("ok\n", debugger.out);
+			return;
+		} else if (strcmp(command, "break") == 0 && argc > 0) {
+			debugger.breakpoint[loc] = 1;
+			fprintf(debugger.out, "ok %03X\n", loc);
+		} else if (strcmp(command, "clear") == 0 && argc > 0) {
+			debugger.breakpoint[loc] = 0;
+			fprintf(debugger.out, "ok %03X\n", loc);
+		} else if (strcmp(command, "watch") == 0 && argc > 0) {
+			debugger.watch[loc >> 3] |= (u_int8_t)(1 << (loc & 7));
+			fprintf(debugger.out, "ok %03X\n", loc);
+		} else if (strcmp(command, "unwatch") == 0 && argc > 0) {
+			debugger.watch[loc >> 3] &= (u_int8_t)(~(1 << (loc & 7)));
+			fprintf(debugger.out, "ok %03X\n", loc);
+		} else if (strcmp(command, "read") == 0 && argc > 0) {
+			int count = argc > 1 ? atoi(arg1) : 1;
+			fputs("ok", debugger.out);
+			for (int i = loc; i < loc + count && i < MEM_SIZE; i++) {
+				fprintf(debugger.out, " %04X", machine.memory[i]);
+			}
+			fputc('\n', debugger.out);
+		} else if (strcmp(command, "write") == 0 && argc > 1) {
+			machine.memory[loc] = (u_int16_t)(strtol(arg1, NULL, 16));
+			fprintf(debugger.out, "ok %03X\n", loc);
+		} else if (strcmp(command, "symbol") == 0 && argc > 0) {
+			fprintf(debugger.out, "ok %03X\n", loc);
+		} else if (strcmp(command, "regs") == 0) {
+			fprintf (
+				debugger.out,
+				"ok pc %03X r %04X ptr %04X > %01X = %01X < %01X\n",
+				machine.counter, machine.reg, machine.ptr,
+				machine.flag_gt, machine.flag_eq, machine.flag_lt);
+		} else if (strcmp(command, "save") == 0) {
+			debugSave();
+		} else if (strcmp(command, "quit") == 0) {
+			fputs("ok\n", debugger.out);
+			exit(EXIT_SUCCESS);
+		} else {
+			fprintf(debugger.out, "err bad command %s", line);
+		}
+	}
+
+	// the debugger went away, so let the program run freely
+	fclose(debugger.in);
+	fclose(debugger.out);
+	debugger.in  = NULL;
+	debugger.out = NULL;
+	debugger.steps = 0;
+	memset(debugger.breakpoint, 0, MEM_SIZE);
+	memset(debugger.watch, 0, sizeof(debugger.watch));
+}
+
+// debugSave
+// Parks a compact snapshot of the machine, and reports its number and how many
+// bytes it takes up.
+void debugSave (void) {
+	if (debugger.savecount >= debugger.savesize) {
+		debugger.savesize = debugger.savesize == 0 ? 8 : debugger.savesize * 2;
+		debugger.saves = realloc (
+			debugger.saves, debugger.savesize * sizeof(Instance *));
+	}
+
+	Instance *save = instanceNew(debugger.arena, debugger.image);
+	if (save == NULL || instanceSave(debugger.arena, save, machine.memory)) {
+		if (save != NULL) { instanceDelete(debugger.arena, save); }
+		fputs("err out of memory\n", debugger.out);
+		return;
+	}
+	save->counter = (u_int16_t)(machine.counter);
+	save->reg     = machine.reg;
+	save->ptr     = machine.ptr;
+	save->flags   = (u_int8_t)(
+		(machine.flag_gt ? FLAG_GT : 0) |
+		(machine.flag_eq ? FLAG_EQ : 0) |
+		(machine.flag_lt ? FLAG_LT : 0));
+
+	debugger.saves[debugger.savecount] = save;
+	fprintf (
+		debugger.out, "ok %zu %zu\n",
+		debugger.savecount++, instanceSize(save));
+}
+
+// debugRestore
+// Puts the machine back into the state of a snapshot taken with debugSave. The
+// program carries on from there once it is told to.
+void debugRestore (const char *number) {
+	char *end;
+	unsigned long index = strtoul(number, &end, 10);
+	if (*end != 0 || index >= debugger.savecount) {
+		fprintf(debugger.out, "err unknown snapshot %s\n", number);
+		return;
+	}
+
+	Instance *save = debugger.saves[index];
+	instanceLoad(save, machine.memory);
+	machine.counter = save->counter;
+	machine.reg     = save->reg;
+	machine.ptr     = save->ptr;
+	machine.flag_gt = (save->flags & FLAG_GT) != 0;
+	machine.flag_eq = (save->flags & FLAG_EQ) != 0;
+	machine.flag_lt = (save->flags & FLAG_LT) != 0;
+	debugger.halted = 0;
+	fprintf(debugger.out, "ok %03X\n", machine.counter);
+}
+
+// debugLocation
+// Resolves a location given to the debugger into an address. Symbol names are
+// tried first, and then hex addresses. If neither works, it returns -1.
+int debugLocation (const char *name) {
+	int addr = findSymbol(name);
+	if (addr >= 0) { return addr; }
+
+	char *end;
+	long value = strtol(name, &end, 16);
+	if (*end != 0 || end == name || value < 0 || value >= MEM_SIZE) {
+		return -1;
+	}
+	return (int)(value);
 }
 
 // debugCPUState
@@ -395,3 +1208,241 @@ void debugCPUState (void) {
 		machine.reg, machine.ptr,
 		machine.flag_gt, machine.flag_eq, machine.flag_lt);
 }
+
+// exceededLimit
+// Ends the program once it has run more instructions than the limit given with
+// -n. It exits with a status of 2 so that it can be told apart from other
+// errors.
+void exceededLimit (void) {
+	fflush(stdout);
+	fprintf (
+		stderr, "ERR instruction limit of %llu reached at %03X\n",
+		(unsigned long long)(options.limit), machine.counter);
+	exit(2);
+}
+
+// timingStart
+// Loads a cost table for the timing model, unless path is "-", in which case
+// the built in one is kept. Each line of the table holds a key and a number of
+// ticks. Keys are an opcode as a hex digit, "mem" for each memory access,
+// "ptr" for going through the pointer, and "jump" for taking a jump. Lines
+// starting with # are ignored. On success, it returns 0. If the table could
+// not be read, it returns 1.
+int timingStart (const char *path) {
+	if (strcmp(path, "-") != 0) {
+		FILE *file = fopen(path, "r");
+		if (file == NULL) { return 1; }
+
+		char line[64], key[16];
+		unsigned int ticks;
+		while (fgets(line, sizeof(line), file) != NULL) {
+			if (line[0] == '#' || sscanf(line, "%15s %u", key, &ticks) != 2) {
+				continue;
+			}
+
+			char *end;
+			long opcode = strtol(key, &end, 16);
+			if (strcmp(key, "mem") == 0) {
+				timing.memory = ticks;
+			} else if (strcmp(key, "ptr") == 0) {
+				timing.pointer = ticks;
+			} else if (strcmp(key, "jump") == 0) {
+				timing.jump = ticks;
+			} else if (*end == 0 && end != key && opcode >= 0 && opcode < 16) {
+				timing.opcode[opcode] = ticks;
+			} else {
+				fclose(file);
+				return 1;
+			}
+		}
+		fclose(file);
+	}
+
+	// work out what each opcode costs before any extras
+	for (int i = 0; i < 16; i++) {
+		timing.step[i] = timing.opcode[i] + mcAccesses[i] * timing.memory;
+	}
+	timing.leader[0] = 1;
+	return 0;
+}
+
+// timingStep
+// Tallies the ticks that the instruction at pc took, and marks where basic
+// blocks start. It is called after the instruction has run. Whether a jump was
+// taken is worked out from the flags the same way as when running it, since a
+// jump to the next cell doesn't move the program counter.
+void timingStep (u_int16_t pc, u_int16_t instruction) {
+	u_int16_t opcode = instruction >> 12;
+	u_int64_t ticks  = timing.step[opcode];
+	int taken =
+		(opcode == 0xb) ||
+		(opcode == 0xc &&  machine.flag_gt) ||
+		(opcode == 0xd &&  machine.flag_lt) ||
+		(opcode == 0xe &&  machine.flag_eq) ||
+		(opcode == 0xf && !machine.flag_eq);
+
+	if ((instruction & 0xFFF) == 0xFFF) { ticks += timing.pointer; }
+	if (taken) {
+		ticks += timing.jump;
+		timing.leader[machine.address] = 1;
+	}
+	if (opcode >= 0xb && pc + 1 < MEM_SIZE) { timing.leader[pc + 1] = 1; }
+
+	timing.ticks[pc] += ticks;
+	timing.runs[pc]++;
+}
+
+// timingReport
+// Prints the estimated redstone ticks for the whole run, for each basic block
+// that was run, and for each label if symbols were loaded.
+void timingReport (void) {
+	u_int64_t total = 0;
+	for (int i = 0; i < MEM_SIZE; i++) { total += timing.ticks[i]; }
+	fprintf (
+		stderr, "timing: %llu ticks over %llu instructions\n",
+		(unsigned long long)(total), (unsigned long long)(stats.retired));
+
+	// a block runs from its leader up to the next leader, or to the first
+	// cell that never ran
+	for (int start = 0; start < MEM_SIZE;) {
+		if (timing.runs[start] == 0) {
+			start++;
+			continue;
+		}
+
+		int end = start;
+		u_int64_t ticks = timing.ticks[start];
+		while (
+			end + 1 < MEM_SIZE && !timing.leader[end + 1] &&
+			timing.runs[end + 1] > 0
+		) {
+			ticks += timing.ticks[++end];
+		}
+
+		fprintf (
+			stderr, "timing: block %03X-%03X %10llu ticks %8llu runs\n",
+			start, end, (unsigned long long)(ticks),
+			(unsigned long long)(timing.runs[start]));
+		start = end + 1;
+	}
+
+	if (symbols.count == 0) { return; }
+
+	// each cell belongs to the closest label at or before it. variables
+	// don't split up the code around them.
+	qsort(symbols.list, symbols.count, sizeof(Symbol), compareSymbols);
+	for (size_t i = 0; i < symbols.count; i++) {
+		if (symbols.list[i].kind != SYMBOL_LABEL) { continue; }
+
+		size_t next = i + 1;
+		while (
+			next < symbols.count &&
+			symbols.list[next].kind != SYMBOL_LABEL
+		) {
+			next++;
+		}
+
+		int start = symbols.list[i].addr;
+		int end   = next < symbols.count ? symbols.list[next].addr : MEM_SIZE;
+		u_int64_t ticks = 0;
+		for (int j = start; j < end; j++) { ticks += timing.ticks[j]; }
+		if (ticks == 0) { continue; }
+
+		fprintf (
+			stderr, "timing: label %-15s %10llu ticks\n",
+			symbols.list[i].name, (unsigned long long)(ticks));
+	}
+}
+
+// compareSymbols
+// Orders symbols by address.
+int compareSymbols (const void *a, const void *b) {
+	return ((const Symbol *)(a))->addr - ((const Symbol *)(b))->addr;
+}
+
+// statsStart
+// Starts the clock for runtime statistics, and sets up everything that writes
+// them out. The calling process is the one that writes them on exit, so that
+// branches and clones don't.
+void statsStart (void) {
+	struct sigaction action = { 0 };
+
+	clock_gettime(CLOCK_MONOTONIC, &stats.start);
+	stats.pid = getpid();
+
+	// anything that gets interrupted carries on, except for waiting for
+	// input, which is done in a way that always stops for signals
+	action.sa_handler = statsSignal;
+	action.sa_flags   = SA_RESTART;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGUSR1, &action, NULL);
+
+	if (options.stats == NULL) { return; }
+	atexit(statsExit);
+	if (options.interval > 0) {
+		sigaction(SIGALRM, &action, NULL);
+		alarm((unsigned int)(options.interval));
+	}
+}
+
+// statsSignal
+// Asks for statistics to be written out before the next instruction runs. The
+// machine keeps running afterwards.
+void statsSignal (int signal) {
+	stats.dump = 1;
+	memset(debugger.trap, 1, MEM_SIZE);
+	if (signal == SIGALRM) { alarm((unsigned int)(options.interval)); }
+}
+
+// statsExit
+// Writes statistics out when the program exits.
+void statsExit (void) {
+	if (getpid() == stats.pid) { statsWrite(); }
+}
+
+// statsWrite
+// Writes statistics out as a JSON object. If a file was given with -j, it is
+// overwritten, and otherwise the object is written to stderr.
+void statsWrite (void) {
+	int toFile = options.stats != NULL && strcmp(options.stats, "-") != 0;
+	FILE *out = toFile ? fopen(options.stats, "w") : stderr;
+	if (out == NULL) { return; }
+
+	double elapsed   = secondsSince(&stats.start);
+	double inputWait = stats.inputWait;
+	if (stats.waiting) { inputWait += secondsSince(&stats.inputStart); }
+	double running = elapsed - inputWait;
+
+	fprintf(out, "{\"instructions\":%llu,\"opcodes\":[",
+		(unsigned long long)(stats.retired));
+	for (int i = 0; i < 16; i++) {
+		fprintf(out, "%s%llu", i ? "," : "",
+			(unsigned long long)(stats.opcodes[i]));
+	}
+	fprintf (
+		out,
+		"],\"charsIn\":%llu,\"charsOut\":%llu,"
+		"\"selfModifyingWrites\":%llu,"
+		"\"elapsedSeconds\":%.6f,\"inputWaitSeconds\":%.6f,"
+		"\"mips\":%.3f}\n",
+		(unsigned long long)(stats.charsIn),
+		(unsigned long long)(stats.charsOut),
+		(unsigned long long)(stats.selfModifying),
+		elapsed, inputWait,
+		running > 0 ? (double)(stats.retired) / running / 1e6 : 0.0);
+
+	if (toFile) {
+		fclose(out);
+	} else {
+		fflush(out);
+	}
+}
+
+// secondsSince
+// Returns how many seconds have passed since the given time.
+double secondsSince (struct timespec *start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (double)(now.tv_sec - start->tv_sec) +
+		(double)(now.tv_nsec - start->tv_nsec) / 1e9;
+}